@@ -70,11 +70,13 @@ void SliceModel::apply_overlay(tipl::color_image& show_image,
 // ---------------------------------------------------------------------------
 std::pair<float,float> SliceModel::get_value_range(void) const
 {
+    handle->view_item[view_id].check_scale();
     return std::make_pair(handle->view_item[view_id].min_value,handle->view_item[view_id].max_value);
 }
 // ---------------------------------------------------------------------------
 std::pair<float,float> SliceModel::get_contrast_range(void) const
 {
+    handle->view_item[view_id].check_scale();
     return std::make_pair(handle->view_item[view_id].contrast_min,handle->view_item[view_id].contrast_max);
 }
 // ---------------------------------------------------------------------------
@@ -85,6 +87,7 @@ std::pair<unsigned int,unsigned int> SliceModel::get_contrast_color(void) const
 // ---------------------------------------------------------------------------
 void SliceModel::set_contrast_range(float min_v,float max_v)
 {
+    handle->view_item[view_id].check_scale();
     handle->view_item[view_id].contrast_min = min_v;
     handle->view_item[view_id].contrast_max = max_v;
 }
@@ -172,7 +172,7 @@ bool load_region(std::shared_ptr<fib_data> handle,
 int trk_post(std::shared_ptr<fib_data> handle,
              TractModel& tract_model,
              const std::string& file_name);
-std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name);
+std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name,bool exclusive = false);
 int ana(void)
 {
     std::shared_ptr<fib_data> handle = cmd_load_fib(po.get("source"));
@@ -183,8 +183,13 @@ int ana(void)
         std::cout << "export information from " << po.get("atlas") << std::endl;
         if(!atl_load_atlas(po.get("atlas")))
             return 0;
+        QStringList atlas_names = QString(po.get("atlas").c_str()).split(",");
         for(unsigned int i = 0;i < atlas_list.size();++i)
         {
+            // atlas_list may hold atlases loaded by earlier server jobs
+            if(!atlas_names.contains(atlas_list[i].name.c_str()) &&
+               !atlas_names.contains(atlas_list[i].filename.c_str()))
+                continue;
             std::vector<std::shared_ptr<ROIRegion> > regions;
             std::vector<std::string> region_list;
             for(unsigned int j = 0;j < atlas_list[i].get_list().size();++j)
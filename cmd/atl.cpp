@@ -2,6 +2,7 @@
 #include <QFileInfo>
 #include <QApplication>
 #include <QDir>
+#include <thread>
 #include "tipl/tipl.hpp"
 #include "mapping/fa_template.hpp"
 #include "libs/gzip_interface.hpp"
@@ -14,19 +15,27 @@ extern std::vector<atlas> atlas_list;
 extern std::string fib_template_file_name_1mm,fib_template_file_name_2mm;
 std::string get_fa_template_path(void);
 const char* odf_average(const char* out_name,std::vector<std::string>& file_names);
+// set on server job threads. Jobs only read atlas_list, which the server updates between jobs.
+thread_local bool atlas_list_read_only = false;
 bool atl_load_atlas(std::string atlas_name)
 {
     QStringList name_list = QString(atlas_name.c_str()).split(",");
-
+    std::vector<unsigned int> new_atlas;
 
     for(unsigned int index = 0;index < name_list.size();++index)
     {
         bool has_atlas = false;
         for(unsigned int i = 0;i < atlas_list.size();++i)
-            if(atlas_list[i].name == name_list[index].toStdString())
+            if(atlas_list[i].name == name_list[index].toStdString() ||
+               atlas_list[i].filename == name_list[index].toStdString())
                 has_atlas = true;
         if(has_atlas)
             continue;
+        if(atlas_list_read_only)
+        {
+            std::cout << name_list[index].toStdString() << " is not loaded by the server and cannot be loaded within a job" << std::endl;
+            return false;
+        }
         std::string file_path;
         if(QFileInfo(name_list[index]).exists())
         {
@@ -47,21 +56,67 @@ bool atl_load_atlas(std::string atlas_name)
                 return false;
             }
         }
+        std::cout << "loading " << name_list[index].toStdString() << "..." << std::endl;
+        atlas_list.push_back(atlas());
+        atlas_list.back().filename = file_path;
+        atlas_list.back().name = name_list[index].toStdString();
+        new_atlas.push_back(atlas_list.size()-1);
+    }
+    // the atlases are decoded concurrently
+    std::vector<std::string> error_msg(new_atlas.size());
+    tipl::par_for(new_atlas.size(),[&](unsigned int i)
+    {
+        atlas& data = atlas_list[new_atlas[i]];
+        try{
+            if(data.get_num().empty())
+                error_msg[i] = "Invalid file format. No ROI found in " + data.name + ".";
+        }
+        catch(const std::exception& e)
+        {
+            error_msg[i] = data.name + ": " + e.what();
+        }
+    });
+    for(unsigned int i = 0;i < error_msg.size();++i)
+        if(!error_msg[i].empty())
+        {
+            std::cout << error_msg[i] << std::endl;
+            return false;
+        }
+    return true;
+}
 
+// returns the atlas loaded by atl_load_atlas. A server job cannot add to atlas_list,
+// so an atlas file it has not loaded yet goes to job_atlas instead.
+atlas* atl_get_atlas(std::string atlas_name,std::shared_ptr<atlas>& job_atlas)
+{
+    std::string name = QFileInfo(atlas_name.c_str()).exists() ? QFileInfo(atlas_name.c_str()).baseName().toStdString():atlas_name;
+    for(int pass = 0;pass < 2;++pass)
+    {
+        for(unsigned int i = 0;i < atlas_list.size();++i)
+            if(atlas_list[i].filename == atlas_name || atlas_list[i].name == name)
+                return &atlas_list[i];
+        if(pass)
+            break;
+        if(atlas_list_read_only && QFileInfo(atlas_name.c_str()).exists())
         {
-            std::cout << "loading " << name_list[index].toStdString() << "..." << std::endl;
-            atlas_list.push_back(atlas());
-            atlas_list.back().filename = file_path;
-            atlas_list.back().name = name_list[index].toStdString();
-            if(atlas_list.back().get_num().empty())
+            job_atlas = std::make_shared<atlas>();
+            job_atlas->filename = atlas_name;
+            job_atlas->name = name;
+            try{
+                if(!job_atlas->get_num().empty())
+                    return job_atlas.get();
+                std::cout << "Invalid file format. No ROI found in " << name << "." << std::endl;
+            }
+            catch(const std::exception& e)
             {
-                std::cout << "Invalid file format. No ROI found in " << name_list[index].toStdString() << "." << std::endl;
-                return false;
+                std::cout << name << ": " << e.what() << std::endl;
             }
-            continue;
+            return 0;
         }
+        if(!atl_load_atlas(atlas_name))
+            return 0;
     }
-    return true;
+    return 0;
 }
 
 void atl_save_mapping(const std::string& file_name,const tipl::geometry<3>& geo,
@@ -196,21 +251,22 @@ int atl(void)
         std::string index_name = po.get("index_name","sdf");
         std::cout << "Extracting index:" << index_name << std::endl;
         data->handle->db.index_name = index_name;
+        std::vector<std::string> subject_names;
         for (unsigned int index = 0;index < name_list.size();++index)
+            subject_names.push_back(QFileInfo(name_list[index].c_str()).baseName().toStdString());
+        if(!data->handle->db.add_subject_files(name_list,subject_names,
+                                               po.get("thread_count",int(std::thread::hardware_concurrency())),
+                                               size_t(po.get("memory_budget",0))*1024*1024,std::cout))
         {
-            std::cout << "Reading " << name_list[index] << std::endl;
-            if(!data->handle->db.add_subject_file(name_list[index],
-                QFileInfo(name_list[index].c_str()).baseName().toStdString()))
-            {
-                std::cout << "Error loading subject fib files:" << data->handle->error_msg << std::endl;
-                return 0;
-            }
+            std::cout << "Error loading subject fib files:" << data->handle->error_msg << std::endl;
+            return 0;
         }
         // Output
         std::string output = dir;
         output += "/";
         output += "connectometry.db.fib.gz";
-        if(!data->handle->db.save_subject_data(output.c_str()))
+        // --voxel_major=1 stores the subject data in a memory-mapped file next to the db
+        if(!data->handle->db.save_subject_data(output.c_str(),po.get("voxel_major",0)))
         {
             std::cout << "Error saving the db file:" << data->handle->error_msg << std::endl;
             return 0;
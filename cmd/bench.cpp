@@ -0,0 +1,753 @@
+#include <QFileInfo>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <random>
+#include <numeric>
+#include <cstring>
+#include "tipl/tipl.hpp"
+#include "libs/tracking/tracking_thread.hpp"
+#include "libs/tracking/tract_model.hpp"
+#include "fib_data.hpp"
+#include "libs/vbc/vbc_database.h"
+#include "libs/dsi/odf_decomposition.hpp"
+#include "libs/dsi/dti_process.hpp"
+#include "program_option.hpp"
+#include "dicom/dwi_header.hpp"
+#ifdef WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+extern track_recognition track_network;
+std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name,bool exclusive = false);
+
+size_t get_peak_memory_kb(void)
+{
+#ifdef WIN32
+    PROCESS_MEMORY_COUNTERS info;
+    if(GetProcessMemoryInfo(GetCurrentProcess(),&info,sizeof(info)))
+        return info.PeakWorkingSetSize >> 10;
+    return 0;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF,&usage))
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss >> 10; // bytes on mac
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+/**
+ synthetic phantom: the lower half contains two orthogonal bundles crossing at the center,
+ the upper half contains a quarter-circle bundle to exercise curved propagation
+ */
+bool create_benchmark_fib(fib_data& handle)
+{
+    tipl::geometry<3> dim(64,64,40);
+    tipl::vector<3> vs(2.0f,2.0f,2.0f);
+    std::vector<float> fa0(dim.size()),fa1(dim.size()),dir0(dim.size()*3),dir1(dim.size()*3);
+    for(tipl::pixel_index<3> index(dim);index < dim.size();++index)
+    {
+        int x = index[0],y = index[1],z = index[2];
+        float* d0 = &dir0[index.index()*3];
+        float* d1 = &dir1[index.index()*3];
+        if(z < 20)
+        {
+            bool in_x_bundle = y >= 24 && y < 40 && x >= 4 && x < 60;
+            bool in_y_bundle = x >= 24 && x < 40 && y >= 4 && y < 60;
+            if(in_x_bundle && in_y_bundle)
+            {
+                fa0[index.index()] = 0.4f;
+                fa1[index.index()] = 0.35f;
+                d0[0] = 1.0f;
+                d1[1] = 1.0f;
+                continue;
+            }
+            if(in_x_bundle)
+            {
+                fa0[index.index()] = 0.6f;
+                d0[0] = 1.0f;
+            }
+            if(in_y_bundle)
+            {
+                fa0[index.index()] = 0.6f;
+                d0[1] = 1.0f;
+            }
+        }
+        else
+        {
+            float dx = x-8.0f,dy = y-8.0f;
+            float r = std::sqrt(dx*dx+dy*dy);
+            if(dx >= 0.0f && dy >= 0.0f && r >= 30.0f && r < 42.0f)
+            {
+                fa0[index.index()] = 0.6f;
+                d0[0] = -dy/r;
+                d0[1] = dx/r;
+            }
+        }
+    }
+    handle.dim = dim;
+    handle.vs = vs;
+    handle.mat_reader.add("dimension",dim.begin(),3,1);
+    handle.mat_reader.add("voxel_size",&*vs.begin(),3,1);
+    handle.mat_reader.add("fa0",&*fa0.begin(),1,fa0.size());
+    handle.mat_reader.add("fa1",&*fa1.begin(),1,fa1.size());
+    handle.mat_reader.add("dir0",&*dir0.begin(),3,dim.size());
+    handle.mat_reader.add("dir1",&*dir1.begin(),3,dim.size());
+    return handle.load_from_mat();
+}
+
+// order-independent checksum of the tract coordinates quantized to 1/100 voxel
+unsigned long long get_tract_checksum(const std::vector<std::vector<float> >& tracts)
+{
+    unsigned long long sum = 0;
+    for(unsigned int i = 0;i < tracts.size();++i)
+    {
+        unsigned long long h = 14695981039346656037ULL;
+        for(unsigned int j = 0;j < tracts[i].size();++j)
+        {
+            h ^= (unsigned long long)(long long)std::round(tracts[i][j]*100.0f);
+            h *= 1099511628211ULL;
+        }
+        sum += h;
+    }
+    return sum;
+}
+
+struct benchmark_case{
+    std::string name;
+    unsigned char method;
+    bool use_roi;
+};
+
+void setup_benchmark_tracking(ThreadData& thread,const fib_data& handle,const benchmark_case& bc,unsigned int count)
+{
+    thread.param.threshold = 0.1f;
+    thread.param.cull_cos_angle = std::cos(60.0*3.14159265358979323846/180.0);
+    thread.param.step_size = bc.method == 2 ? handle.vs[0] : handle.vs[0]*0.5f;
+    thread.param.smooth_fraction = 0.0f;
+    thread.param.min_length = 10.0f;
+    thread.param.max_length = 300.0f;
+    thread.param.tracking_method = bc.method;
+    thread.param.initial_direction = 0;
+    thread.param.interpolation_strategy = 0;
+    thread.param.stop_by_tract = 1;
+    thread.param.center_seed = 0;
+    thread.param.random_seed = 0;
+    thread.param.termination_count = count;
+    thread.param.max_seed_count = count*50;
+
+    std::vector<tipl::vector<3,short> > seed,roi,roa;
+    for(tipl::pixel_index<3> index(handle.dim);index < handle.dim.size();++index)
+    {
+        if(handle.dir.fa[0][index.index()] > 0.0f)
+            seed.push_back(tipl::vector<3,short>(index.begin()));
+        if(index[2] < 20 && index[0] >= 30 && index[0] < 34 && index[1] >= 30 && index[1] < 34)
+            roi.push_back(tipl::vector<3,short>(index.begin()));
+        if(index[2] >= 20 && index[0] >= 30 && index[0] < 34)
+            roa.push_back(tipl::vector<3,short>(index.begin()));
+    }
+    thread.roi_mgr.setRegions(handle.dim,seed,1.0,3,"whole brain",tipl::vector<3>());
+    if(bc.use_roi)
+    {
+        thread.roi_mgr.setRegions(handle.dim,roi,1.0,0,"crossing",tipl::vector<3>());
+        thread.roi_mgr.setRegions(handle.dim,roa,1.0,1,"curved",tipl::vector<3>());
+    }
+}
+
+void motion_detection(std::vector<std::shared_ptr<std::future<void> > >& threads,
+                      std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
+                      unsigned int& ref_index,
+                      std::vector<tipl::affine_transform<double> >& arg,
+                      std::vector<double>& reg_time,
+                      bool& terminated,
+                      std::atomic<unsigned int>& finished,
+                      unsigned int thread_count);
+void motion_correction(std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
+                       unsigned int ref_index,
+                       const std::vector<tipl::affine_transform<double> >& arg);
+
+// mean absolute difference to the reference volume
+double get_motion_residual(const std::vector<std::shared_ptr<DwiHeader> >& dwi_files,unsigned int ref_index)
+{
+    double sum = 0.0;
+    for(unsigned int i = 0;i < dwi_files.size();++i)
+        for(unsigned int j = 0;j < dwi_files[i]->image.size();++j)
+            sum += std::abs(double(dwi_files[i]->image[j])-double(dwi_files[ref_index]->image[j]));
+    return sum/double(dwi_files.size()*dwi_files[ref_index]->image.size());
+}
+
+/**
+ motion correction benchmark: a smooth phantom shifted and rotated by known amounts per volume.
+ Compares a single registration thread against thread_count threads.
+ */
+int bench_motion(void)
+{
+    unsigned int thread_count = po.get("thread_count",int(std::thread::hardware_concurrency()));
+    unsigned int volume_count = po.get("volume_count",30);
+    tipl::geometry<3> dim(64,64,40);
+    tipl::image<unsigned short,3> phantom(dim);
+    for(tipl::pixel_index<3> index(dim);index < dim.size();++index)
+    {
+        float x = (index[0]-32.0f)/24.0f,y = (index[1]-32.0f)/28.0f,z = (index[2]-20.0f)/16.0f;
+        float r2 = x*x+y*y+z*z;
+        if(r2 < 1.0f)
+            phantom[index.index()] = (unsigned short)(600.0f+300.0f*std::sin(index[0]*0.3f)*std::cos(index[1]*0.2f+index[2]*0.1f));
+    }
+    std::vector<std::shared_ptr<DwiHeader> > source;
+    for(unsigned int i = 0;i < volume_count;++i)
+    {
+        source.push_back(std::make_shared<DwiHeader>());
+        source.back()->bvalue = (i % 6 == 0) ? 0.0f : 1000.0f;
+        source.back()->bvec = tipl::vector<3>(std::cos(float(i)),std::sin(float(i)),0.5f);
+        source.back()->bvec.normalize();
+        tipl::affine_transform<double> arg;
+        if(i)
+        {
+            arg.translocation[0] = 2.0*std::sin(i*0.7);
+            arg.translocation[1] = 1.5*std::cos(i*0.5);
+            arg.translocation[2] = 0.1*(i % 5);
+            arg.rotation[2] = 0.02*std::sin(i*0.3);
+        }
+        tipl::vector<3> vs(1,1,1);
+        source.back()->image.resize(dim);
+        tipl::resample(phantom,source.back()->image,
+                       tipl::transformation_matrix<double>(arg,dim,vs,dim,vs),tipl::linear);
+        source.back()->voxel_size[0] = source.back()->voxel_size[1] = source.back()->voxel_size[2] = 2.0f;
+    }
+    std::cout << "volume_count=" << volume_count << " residual before correction=" << get_motion_residual(source,0) << std::endl;
+    std::vector<unsigned int> thread_counts = {1,std::max<unsigned int>(1,thread_count)};
+    for(unsigned int run = 0;run < thread_counts.size();++run)
+    {
+        std::vector<std::shared_ptr<DwiHeader> > dwi_files;
+        for(unsigned int i = 0;i < source.size();++i)
+            dwi_files.push_back(std::make_shared<DwiHeader>(*source[i]));
+        std::vector<std::shared_ptr<std::future<void> > > threads;
+        std::vector<tipl::affine_transform<double> > arg;
+        std::vector<double> reg_time;
+        unsigned int ref_index = 0;
+        bool terminated = false;
+        std::atomic<unsigned int> finished(0);
+        auto t0 = std::chrono::high_resolution_clock::now();
+        motion_detection(threads,dwi_files,ref_index,arg,reg_time,terminated,finished,thread_counts[run]);
+        for(unsigned int i = 0;i < threads.size();++i)
+            threads[i]->wait();
+        auto t1 = std::chrono::high_resolution_clock::now();
+        motion_correction(dwi_files,ref_index,arg);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::cout << "thread_count=" << thread_counts[run]
+                  << "\tregistration=" << std::chrono::duration<double>(t1-t0).count() << "s"
+                  << "\tresampling=" << std::chrono::duration<double>(t2-t1).count() << "s"
+                  << "\tresidual=" << get_motion_residual(dwi_files,ref_index) << std::endl;
+        std::cout << "\tper volume:";
+        for(unsigned int i = 0;i < reg_time.size();++i)
+            std::cout << " " << reg_time[i];
+        std::cout << std::endl;
+    }
+    return 0;
+}
+
+/**
+ connectivity matrix benchmark: random straight tracts on the synthetic phantom and cubic regions
+ --track_count: number of tracts (default 1000000)
+ --region_count: approximate number of regions (default 1000)
+ Reports tracts/s of ConnectivityMatrix::calculate for each matrix value type.
+ */
+int bench_connectivity(void)
+{
+    unsigned int track_count = po.get("track_count",1000000);
+    unsigned int region_count = std::max<int>(2,po.get("region_count",1000));
+    std::shared_ptr<fib_data> handle(new fib_data);
+    if(!create_benchmark_fib(*handle))
+    {
+        std::cout << "Cannot create synthetic fib:" << handle->error_msg << std::endl;
+        return 1;
+    }
+    tipl::geometry<3> dim = handle->dim;
+    ConnectivityMatrix data;
+    {
+        int size = std::max<int>(1,std::round(std::pow(float(dim.size())/float(region_count),1.0f/3.0f)));
+        tipl::vector<3,int> grid((dim[0]+size-1)/size,(dim[1]+size-1)/size,(dim[2]+size-1)/size);
+        data.regions.resize(grid[0]*grid[1]*grid[2]);
+        for(tipl::pixel_index<3> index(dim);index < dim.size();++index)
+            data.regions[(index[2]/size*grid[1]+index[1]/size)*grid[0]+index[0]/size].
+                    push_back(tipl::vector<3,short>(index.begin()));
+        for(unsigned int i = 0;i < data.regions.size();++i)
+            data.region_name.push_back(std::to_string(i));
+    }
+    TractModel tract_model(handle);
+    {
+        std::vector<std::vector<float> > tracts(track_count);
+        tipl::par_for(track_count,[&](unsigned int i)
+        {
+            // fixed seed per tract so that the tracts do not depend on the thread count
+            std::mt19937 gen(i);
+            std::uniform_real_distribution<float> x(0.0f,dim[0]-1),y(0.0f,dim[1]-1),z(0.0f,dim[2]-1);
+            tipl::vector<3> from(x(gen),y(gen),z(gen)),to(x(gen),y(gen),z(gen));
+            unsigned int steps = std::max<unsigned int>(2,(to-from).length());
+            for(unsigned int j = 0;j <= steps;++j)
+            {
+                tipl::vector<3> pos(from+(to-from)*(float(j)/float(steps)));
+                tracts[i].insert(tracts[i].end(),pos.begin(),pos.end());
+            }
+        });
+        tract_model.add_tracts(tracts);
+    }
+    std::cout << "track_count=" << tract_model.get_visible_track_count()
+              << " region_count=" << data.regions.size() << std::endl;
+    std::vector<std::string> types = {"count","ncount","ncount2","mean_length",handle->dir.fa.size() == 1 ? "fa":"qa"};
+    for(unsigned int end_only = 0;end_only < 2;++end_only)
+        for(unsigned int i = 0;i < types.size();++i)
+        {
+            auto t0 = std::chrono::high_resolution_clock::now();
+            if(!data.calculate(tract_model,types[i],end_only,0.0f))
+            {
+                std::cout << data.error_msg << std::endl;
+                return 1;
+            }
+            double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+            std::cout << types[i] << (end_only ? "\tend" : "\tpass")
+                      << "\ttime=" << sec << "s"
+                      << "\ttracts/s=" << (sec > 0.0 ? double(tract_model.get_visible_track_count())/sec : 0.0)
+                      << "\tsum=" << std::accumulate(data.matrix_value.begin(),data.matrix_value.end(),0.0) << std::endl;
+        }
+    std::cout << "peak_memory=" << (get_peak_memory_kb() >> 10) << "MB" << std::endl;
+    return 0;
+}
+
+/**
+ validation of the tracking-free null distribution of connectometry on synthetic t-statistics maps
+ null maps are rectified noise on the phantom fibers, and signal maps add --effect to the x bundle.
+ --permutation_count: number of null and signal maps (default 200)
+ --t_threshold: threshold of the maps (default 1.5)
+ Reports the FDR of each length from tracking and from the voxel graph, and their time.
+ */
+int bench_connectometry_null(void)
+{
+    unsigned int permutation_count = std::max<int>(1,po.get("permutation_count",200));
+    float effect = po.get("effect",2.0f);
+    vbc_database vbc;
+    vbc.handle.reset(new fib_data);
+    if(!create_benchmark_fib(*vbc.handle))
+    {
+        std::cout << "Cannot create synthetic fib:" << vbc.handle->error_msg << std::endl;
+        return 1;
+    }
+    const fib_data& handle = *vbc.handle;
+    vbc.tracking_threshold = po.get("t_threshold",1.5f);
+    vbc.seed_ratio = po.get("seed_ratio",1.0f);
+    vbc.track_trimming = 0;
+    vbc.fiber_threshold = 0.0f;
+    vbc.voxels_in_threshold = 0;
+    for(unsigned int i = 0;i < handle.dim.size();++i)
+        if(handle.dir.fa[0][i] > 0.0f)
+            ++vbc.voxels_in_threshold;
+
+    tracking_data fib;
+    fib.read(handle);
+    std::vector<std::vector<float> > map(fib.fib_num,std::vector<float>(handle.dim.size()));
+    std::vector<const float*> map_ptr(fib.fib_num);
+    for(unsigned int f = 0;f < fib.fib_num;++f)
+        map_ptr[f] = &map[f][0];
+    fib.fa = map_ptr;
+    auto create_map = [&](unsigned int seed,bool signal)
+    {
+        std::mt19937 gen(seed);
+        std::normal_distribution<float> noise;
+        for(tipl::pixel_index<3> index(handle.dim);index < handle.dim.size();++index)
+            for(unsigned int f = 0;f < fib.fib_num;++f)
+            {
+                float& value = map[f][index.index()];
+                value = 0.0f;
+                if(handle.dir.fa[f][index.index()] <= 0.0f)
+                    continue;
+                value = std::abs(noise(gen));
+                // fiber 0 of the x bundle runs along x
+                if(signal && f == 0 && index[2] < 20 && index[1] >= 24 && index[1] < 40)
+                    value += effect;
+            }
+    };
+
+    std::vector<std::vector<float> > fdr(2);
+    for(unsigned int fast_null = 0;fast_null < 2;++fast_null)
+    {
+        vbc.fast_null = fast_null;
+        vbc.subject_greater_null.clear();
+        vbc.subject_greater_null.resize(200);
+        vbc.subject_greater.clear();
+        vbc.subject_greater.resize(200);
+        vbc.subject_lesser_null = vbc.subject_lesser = vbc.subject_greater;
+        vbc.fdr_greater.resize(200);
+        vbc.fdr_lesser.resize(200);
+        std::vector<std::vector<float> > tracks;
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for(unsigned int i = 0;i < permutation_count;++i)
+        {
+            create_map(i*2,false);
+            vbc.get_length_hist(fib,tracks,vbc.subject_greater_null,false);
+            create_map(i*2+1,true);
+            vbc.get_length_hist(fib,tracks,vbc.subject_greater,false);
+        }
+        double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+        std::cout << (fast_null ? "graph" : "tracking") << "\ttime=" << sec << "s"
+                  << "\tpermutations/s=" << (sec > 0.0 ? double(permutation_count)/sec : 0.0) << std::endl;
+        vbc.calculate_FDR();
+        fdr[fast_null] = vbc.fdr_greater;
+    }
+    float max_difference = 0.0f;
+    std::cout << "length\tfdr_tracking\tfdr_graph" << std::endl;
+    for(unsigned int length = 0;length < 200;++length)
+    {
+        max_difference = std::max(max_difference,std::abs(fdr[0][length]-fdr[1][length]));
+        if(length % 5 == 0)
+            std::cout << length << "\t" << fdr[0][length] << "\t" << fdr[1][length] << std::endl;
+    }
+    std::cout << "max_fdr_difference=" << max_difference << std::endl;
+    return 0;
+}
+
+/**
+ tract recognition benchmark on a human fib file
+ --fib: fib file
+ --tract: tract file to be recognized
+ Reports tracts/s of the per-tract prediction and of track_recognition::predict.
+ Both run the same network on each tract, so label_consistency only checks that predict
+ keeps the tract order and returns the labels of predict_label (expected to be 1).
+ */
+int bench_recognition(void)
+{
+    std::shared_ptr<fib_data> handle = cmd_load_fib(po.get("fib"));
+    if(!handle.get())
+        return 1;
+    if(!handle->is_human_data || !track_network.can_recognize())
+    {
+        std::cout << "Recognition requires human data and the recognition network" << std::endl;
+        return 1;
+    }
+    handle->get_mni_mapping();
+    TractModel tract_model(handle);
+    if(!tract_model.load_from_file(po.get("tract").c_str()))
+    {
+        std::cout << "Cannot load tracts from " << po.get("tract") << std::endl;
+        return 1;
+    }
+    const std::vector<std::vector<float> >& tracts = tract_model.get_tracts();
+    std::vector<int> label(tracts.size(),-1),batch_label(tracts.size(),-1);
+    auto t0 = std::chrono::high_resolution_clock::now();
+    tipl::par_for(tracts.size(),[&](unsigned int i)
+    {
+        std::vector<float> input;
+        if(handle->get_profile(tracts[i],input))
+            label[i] = track_network.cnn.predict_label(input);
+    });
+    double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+    t0 = std::chrono::high_resolution_clock::now();
+    unsigned int output_size = track_network.cnn.get_output_size();
+    track_network.predict(handle.get(),tracts,[&](size_t i,const float* output)
+    {
+        batch_label[i] = std::max_element(output,output+output_size)-output;
+    });
+    double batch_sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+    size_t agreed = 0;
+    for(size_t i = 0;i < tracts.size();++i)
+        if(label[i] == batch_label[i])
+            ++agreed;
+    std::cout << "track_count=" << tracts.size() << std::endl;
+    std::cout << "per_tract\ttime=" << sec << "s\ttracts/s=" << (sec > 0.0 ? double(tracts.size())/sec : 0.0) << std::endl;
+    std::cout << "blocked\ttime=" << batch_sec << "s\ttracts/s=" << (batch_sec > 0.0 ? double(tracts.size())/batch_sec : 0.0) << std::endl;
+    std::cout << "label_consistency=" << (tracts.empty() ? 1.0 : double(agreed)/double(tracts.size())) << std::endl;
+    return 0;
+}
+
+/**
+ ODF decomposition benchmark on synthetic crossing dODFs
+ --voxel_count: number of voxels (default 20000)
+ Each voxel has two fibers crossing at 30 to 90 degrees, an isotropic part and noise.
+ Reports voxels/s and a checksum of the decomposed ODFs to compare builds.
+ */
+int bench_decomposition(void)
+{
+    unsigned int voxel_count = std::max<int>(1,po.get("voxel_count",20000));
+    Voxel voxel;
+    voxel.ti.init(8);
+    voxel.odf_decomposition = true;
+    voxel.param[3] = 0.05f; // decomposition fraction
+    voxel.param[4] = 10;    // decomposition m
+    voxel.dim = tipl::geometry<3>(voxel_count,1,1);
+    unsigned int half_odf_size = voxel.ti.half_vertices_count;
+    auto add_fiber = [&](const tipl::vector<3>& dir,float fraction,std::vector<float>& odf)
+    {
+        for(unsigned int j = 0;j < half_odf_size;++j)
+        {
+            float cos_value = dir*tipl::vector<3>(voxel.ti.vertices[j]);
+            odf[j] += fraction*std::exp(-8.0f*(1.0f-cos_value*cos_value));
+        }
+    };
+    voxel.response_function.resize(half_odf_size,0.2f);
+    add_fiber(tipl::vector<3>(1.0f,0.0f,0.0f),1.0f,voxel.response_function);
+    voxel.free_water_diffusion.resize(half_odf_size,1.0f);
+    voxel.reponse_function_scaling = 1.0f;
+    ODFDecomposition decomposition;
+    decomposition.init(voxel);
+
+    std::vector<std::vector<float> > odfs(voxel_count,std::vector<float>(half_odf_size));
+    tipl::par_for(voxel_count,[&](unsigned int i)
+    {
+        std::mt19937 gen(i);
+        std::uniform_real_distribution<float> uniform(0.0f,1.0f);
+        std::normal_distribution<float> noise(0.0f,0.02f);
+        float angle = (30.0f+60.0f*uniform(gen))*3.14159265358979323846f/180.0f;
+        float fraction = 0.3f+0.4f*uniform(gen);
+        std::fill(odfs[i].begin(),odfs[i].end(),0.3f);
+        add_fiber(tipl::vector<3>(1.0f,0.0f,0.0f),fraction,odfs[i]);
+        add_fiber(tipl::vector<3>(std::cos(angle),std::sin(angle),0.0f),1.0f-fraction,odfs[i]);
+        for(unsigned int j = 0;j < half_odf_size;++j)
+            odfs[i][j] += noise(gen);
+    });
+    std::vector<VoxelData> data(std::thread::hardware_concurrency());
+    for(unsigned int i = 0;i < data.size();++i)
+        data[i].odf.resize(half_odf_size);
+    auto t0 = std::chrono::high_resolution_clock::now();
+    tipl::par_for2(voxel_count,[&](unsigned int i,unsigned int id)
+    {
+        data[id].odf = odfs[i];
+        data[id].voxel_index = i;
+        decomposition.run(voxel,data[id]);
+        odfs[i] = data[id].odf;
+    });
+    double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+    unsigned long long checksum = 14695981039346656037ULL;
+    for(unsigned int i = 0;i < voxel_count;++i)
+        for(unsigned int j = 0;j < half_odf_size;++j)
+        {
+            unsigned int bits;
+            std::memcpy(&bits,&odfs[i][j],sizeof(bits));
+            checksum ^= bits;
+            checksum *= 1099511628211ULL;
+        }
+    std::cout << "voxel_count=" << voxel_count << "\todf_size=" << half_odf_size << std::endl;
+    std::cout << "time=" << sec << "s\tvoxels/s=" << (sec > 0.0 ? double(voxel_count)/sec : 0.0) << std::endl;
+    std::cout << "checksum=" << checksum << std::endl;
+    return 0;
+}
+
+/**
+ tensor fitting benchmark on synthetic tensors
+ --voxel_count: number of voxels (default 100000)
+ --dti_wls: refits the tensors with weighted least squares
+ The signals are simulated at b=1000 in 64 directions with noise.
+ Reports voxels/s of the closed-form and the iterative eigen solvers and their largest FA/MD/AD/RD difference.
+ */
+int bench_dti(void)
+{
+    unsigned int voxel_count = std::max<int>(1,po.get("voxel_count",100000));
+    Voxel voxel;
+    voxel.method_id = 1;
+    voxel.dti_wls = po.get("dti_wls",int(0));
+    voxel.dim = tipl::geometry<3>(voxel_count,1,1);
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> uniform(-1.0f,1.0f);
+    voxel.bvalues.push_back(0.0f);
+    voxel.bvectors.push_back(tipl::vector<3,float>());
+    while(voxel.bvalues.size() < 65)
+    {
+        tipl::vector<3,float> dir(uniform(gen),uniform(gen),uniform(gen));
+        if(dir.length() > 1.0f || dir.length() < 0.1f)
+            continue;
+        dir.normalize();
+        voxel.bvalues.push_back(1000.0f);
+        voxel.bvectors.push_back(dir);
+    }
+    std::vector<std::vector<float> > signals(voxel_count);
+    tipl::par_for(voxel_count,[&](unsigned int i)
+    {
+        std::mt19937 gen(i);
+        std::uniform_real_distribution<float> uniform(0.0f,1.0f);
+        std::normal_distribution<float> noise(0.0f,10.0f);
+        tipl::vector<3,float> dir(uniform(gen)-0.5f,uniform(gen)-0.5f,uniform(gen)-0.5f);
+        dir.normalize();
+        float ad = 0.0008f+0.0012f*uniform(gen);
+        float rd = 0.0003f+0.0005f*uniform(gen);
+        signals[i].resize(voxel.bvalues.size());
+        for(unsigned int j = 0;j < voxel.bvalues.size();++j)
+        {
+            float cos_value = dir*voxel.bvectors[j];
+            float adc = rd+(ad-rd)*cos_value*cos_value;
+            signals[i][j] = std::max<float>(1.0f,1000.0f*std::exp(-voxel.bvalues[j]*adc)+noise(gen));
+        }
+    });
+    std::vector<VoxelData> data(std::thread::hardware_concurrency());
+    for(unsigned int i = 0;i < data.size();++i)
+        data[i].fa.resize(1);
+    Dwi2Tensor tensor[2];
+    std::vector<float> fa[2];
+    const char* solver_name[2] = {"iterative","closed-form"};
+    for(unsigned int s = 0;s < 2;++s)
+    {
+        tensor[s].init(voxel);
+        if(s == 1 && !tensor[s].use_fast_eigen)
+            std::cout << "the closed-form solver failed the self-check and is not used" << std::endl;
+        tensor[s].use_fast_eigen = (s == 1);
+        auto t0 = std::chrono::high_resolution_clock::now();
+        tipl::par_for2(voxel_count,[&](unsigned int i,unsigned int id)
+        {
+            data[id].space = signals[i];
+            data[id].voxel_index = i;
+            tensor[s].run(voxel,data[id]);
+        });
+        double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+        std::cout << solver_name[s] << "\ttime=" << sec << "s\tvoxels/s=" << (sec > 0.0 ? double(voxel_count)/sec : 0.0) << std::endl;
+        fa[s] = voxel.fib_fa;
+    }
+    float max_dif[4] = {0.0f,0.0f,0.0f,0.0f};
+    for(unsigned int i = 0;i < voxel_count;++i)
+    {
+        max_dif[0] = std::max<float>(max_dif[0],std::fabs(fa[0][i]-fa[1][i]));
+        max_dif[1] = std::max<float>(max_dif[1],std::fabs(tensor[0].md[i]-tensor[1].md[i]));
+        max_dif[2] = std::max<float>(max_dif[2],std::fabs(tensor[0].d0[i]-tensor[1].d0[i]));
+        max_dif[3] = std::max<float>(max_dif[3],std::fabs(tensor[0].d1[i]-tensor[1].d1[i]));
+    }
+    std::cout << "max difference\tfa=" << max_dif[0] << "\tmd=" << max_dif[1]
+              << "\tad=" << max_dif[2] << "\trd=" << max_dif[3] << std::endl;
+    return 0;
+}
+
+/**
+ headless tracking benchmark with fixed seeds
+ --source: checksum reference file. The results are compared against it.
+ --save: writes the checksums of this run to --source instead. Use it only on a build known to be correct.
+ --type=motion runs the motion correction benchmark instead.
+ --type=connectivity runs the connectivity matrix benchmark instead.
+ --type=connectometry_null compares the tracking-free connectometry null distribution with tracking.
+ --type=recognition compares blocked tract recognition with the per-tract prediction.
+ --type=decomposition runs the ODF decomposition benchmark instead.
+ --type=dti compares the closed-form and iterative eigen solvers of the tensor fitting.
+ */
+int bench(void)
+{
+    if(po.get("type") == std::string("motion"))
+        return bench_motion();
+    if(po.get("type") == std::string("connectivity"))
+        return bench_connectivity();
+    if(po.get("type") == std::string("connectometry_null"))
+        return bench_connectometry_null();
+    if(po.get("type") == std::string("recognition"))
+        return bench_recognition();
+    if(po.get("type") == std::string("decomposition"))
+        return bench_decomposition();
+    if(po.get("type") == std::string("dti"))
+        return bench_dti();
+    const char* termination_name[termination_type_count] =
+        {"accepted","too_long","excluded","too_short","no_include","no_end","seed_rejected","ending_rejected"};
+    unsigned int thread_count = po.get("thread_count",int(std::thread::hardware_concurrency()));
+    unsigned int track_count = po.get("track_count",50000);
+    unsigned int check_count = po.get("check_count",2000);
+    std::string reference_file = po.get("source");
+    bool save_reference = po.get("save",int(0));
+    if(reference_file.empty())
+    {
+        std::cout << "please specify the checksum reference file using --source" << std::endl;
+        return 1;
+    }
+
+    fib_data handle;
+    if(!create_benchmark_fib(handle))
+    {
+        std::cout << "Cannot create synthetic fib:" << handle.error_msg << std::endl;
+        return 1;
+    }
+    tracking_data fib;
+    fib.read(handle);
+
+    std::map<std::string,unsigned long long> reference;
+    bool has_reference = false;
+    if(!save_reference)
+    {
+        std::ifstream in(reference_file.c_str());
+        std::string name;
+        unsigned long long value;
+        while(in >> name >> value)
+        {
+            reference[name] = value;
+            has_reference = true;
+        }
+        if(!has_reference)
+        {
+            std::cout << "cannot read checksum reference at " << reference_file
+                      << ". Run with --save=1 on a known-good build to create it." << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<benchmark_case> cases = {
+        {"streamline",0,false},{"streamline_roi",0,true},
+        {"rk4",1,false},{"rk4_roi",1,true},
+        {"voxel",2,false},{"voxel_roi",2,true}};
+    std::ostringstream new_reference;
+    int mismatch = 0;
+    std::cout << "thread_count=" << thread_count << " track_count=" << track_count << std::endl;
+    for(unsigned int i = 0;i < cases.size();++i)
+    {
+        // throughput run
+        ThreadData tracking_thread;
+        setup_benchmark_tracking(tracking_thread,handle,cases[i],track_count);
+        auto t0 = std::chrono::high_resolution_clock::now();
+        tracking_thread.run(fib,thread_count,true);
+        double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+        size_t steps = 0;
+        for(unsigned int j = 0;j < tracking_thread.track_buffer.size();++j)
+            steps += tracking_thread.track_buffer[j].size()/3;
+        std::vector<unsigned int> hist;
+        tracking_thread.get_termination_hist(hist);
+        std::cout << cases[i].name << "\ttracts=" << tracking_thread.track_buffer.size()
+                  << "\tseeds=" << tracking_thread.get_total_seed_count()
+                  << "\ttime=" << sec << "s"
+                  << "\ttracts/s=" << (sec > 0.0 ? double(tracking_thread.track_buffer.size())/sec : 0.0)
+                  << "\tsteps/s=" << (sec > 0.0 ? double(steps)/sec : 0.0)
+                  << "\tpeak_memory=" << (get_peak_memory_kb() >> 10) << "MB" << std::endl;
+        std::cout << "\ttermination:";
+        for(unsigned int j = 0;j < hist.size();++j)
+            std::cout << " " << termination_name[j] << "=" << hist[j];
+        std::cout << std::endl;
+
+        // result check: a single thread keeps the seed sequence reproducible
+        ThreadData check_thread;
+        setup_benchmark_tracking(check_thread,handle,cases[i],check_count);
+        check_thread.run(fib,1,true);
+        unsigned long long checksum = get_tract_checksum(check_thread.track_buffer);
+        new_reference << cases[i].name << " " << checksum << std::endl;
+        if(has_reference)
+        {
+            if(reference.find(cases[i].name) == reference.end() || reference[cases[i].name] != checksum)
+            {
+                std::cout << "\tchecksum mismatch: " << checksum << " expected " << reference[cases[i].name] << std::endl;
+                ++mismatch;
+            }
+            else
+                std::cout << "\tchecksum matched" << std::endl;
+        }
+    }
+    if(save_reference)
+    {
+        std::ofstream out(reference_file.c_str());
+        out << new_reference.str();
+        if(!out)
+        {
+            std::cout << "cannot save checksum reference to " << reference_file << std::endl;
+            return 1;
+        }
+        std::cout << "checksum reference saved to " << reference_file << std::endl;
+    }
+    return mismatch ? 1 : 0;
+}
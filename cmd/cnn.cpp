@@ -1,9 +1,21 @@
 #include <QApplication>
 #include <QFileInfo>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <cstdio>
 #include "program_option.hpp"
 #include "tipl/tipl.hpp"
 #include "gzip_interface.hpp"
 
+/**
+ trains a network on tract profiles
+ --train: training data, --test: testing data
+ --validation_ratio: fraction of the training data held out for validation when no testing data is given
+ --seed: seed of the validation split. The network still shuffles the samples on its own, so training is not deterministic.
+ --checkpoint: the network is saved here after each epoch, and an existing checkpoint is resumed.
+               The momentum of the optimizer is not saved, so a resumed run is not an exact continuation.
+ */
 int cnn(void)
 {
     std::string train_file_name = po.get("train");
@@ -22,32 +34,88 @@ int cnn(void)
             return 0;
         }
     }
+    // a fixed shuffle so that the validation split is reproducible
+    {
+        std::mt19937 gen(po.get("seed",0));
+        for(size_t i = nn_data.data.size();i > 1;--i)
+        {
+            size_t j = std::uniform_int_distribution<size_t>(0,i-1)(gen);
+            nn_data.data[i-1].swap(nn_data.data[j]);
+            std::swap(nn_data.data_label[i-1],nn_data.data_label[j]);
+        }
+        float validation_ratio = po.get("validation_ratio",0.0f);
+        if(nn_test.empty() && validation_ratio > 0.0f && validation_ratio < 1.0f)
+        {
+            size_t train_size = nn_data.data.size()*(1.0f-validation_ratio);
+            nn_test.data.assign(nn_data.data.begin()+train_size,nn_data.data.end());
+            nn_test.data_label.assign(nn_data.data_label.begin()+train_size,nn_data.data_label.end());
+            nn_data.data.resize(train_size);
+            nn_data.data_label.resize(train_size);
+            std::cout << "validation samples=" << nn_test.data.size() << std::endl;
+        }
+    }
     std::string network = po.get("network");
+    std::string checkpoint = po.get("checkpoint");
+    std::string checkpoint_epoch = checkpoint + ".epoch";
     tipl::ml::network nn;
-
-    if(!(nn << network))
+    unsigned int epoch_done = 0;
+    if(!checkpoint.empty() && QFileInfo(checkpoint.c_str()).exists() &&
+       std::ifstream(checkpoint_epoch.c_str()) >> epoch_done &&
+       nn.load_from_file<gz_istream>(checkpoint.c_str()))
+        std::cout << "resume " << checkpoint << " after epoch " << epoch_done << std::endl;
+    else
     {
-        std::cout << "Invalid network: " << nn.error_msg << std::endl;
-        return 0;
+        epoch_done = 0;
+        if(!(nn << network))
+        {
+            std::cout << "Invalid network: " << nn.error_msg << std::endl;
+            return 0;
+        }
     }
     nn.learning_rate = po.get("learning_rate",0.05f);
     nn.w_decay_rate = po.get("w_decay_rate",0.0001f);
     nn.b_decay_rate = po.get("b_decay_rate",0.2f);
     nn.momentum = po.get("momentum",0.9f);
     nn.batch_size = po.get("batch_size",64);
-    nn.epoch = po.get("epoch",20);
+    unsigned int epoch = po.get("epoch",20);
+    if(epoch_done >= epoch)
+    {
+        std::cout << "all " << epoch << " epochs are done" << std::endl;
+        return 0;
+    }
+    nn.epoch = epoch-epoch_done;
 
     std::cout << "learning rate=" << nn.learning_rate << std::endl;
     std::cout << "weight decay=" << nn.w_decay_rate << std::endl;
     std::cout << "bias decay=" << nn.b_decay_rate << std::endl;
     std::cout << "momentum=" << nn.momentum << std::endl;
     std::cout << "batch size=" << nn.batch_size << std::endl;
-    std::cout << "epoch=" << nn.epoch << std::endl;
+    std::cout << "epoch=" << epoch << std::endl;
+    std::cout << "training samples=" << nn_data.data.size() << std::endl;
 
+    auto epoch_begin = std::chrono::high_resolution_clock::now();
     auto on_enumerate_epoch = [&](){
+        double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-epoch_begin).count();
+        ++epoch_done;
+        std::cout << "epoch " << epoch_done << "\ttime=" << sec << "s"
+                  << "\tsamples/s=" << (sec > 0.0 ? double(nn_data.data.size())/sec : 0.0) << std::endl;
         if(!nn_test.empty())
             std::cout << "testing error:" << nn.test_error(nn_test.data,nn_test.data_label) << "%" << std::endl;
         std::cout << "training error:" << nn.get_training_error() << "%" << std::endl;
+        if(!checkpoint.empty())
+        {
+            // keeps the .gz extension so that the temporary file is compressed in the same way
+            std::string tmp_file = QString(checkpoint.c_str()).endsWith(".gz") ?
+                        checkpoint.substr(0,checkpoint.length()-3) + ".tmp.gz" : checkpoint + ".tmp";
+            nn.save_to_file<gz_ostream>(tmp_file.c_str());
+            if(QFileInfo(tmp_file.c_str()).exists())
+            {
+                std::remove(checkpoint.c_str());
+                std::rename(tmp_file.c_str(),checkpoint.c_str());
+                std::ofstream(checkpoint_epoch.c_str()) << epoch_done;
+            }
+        }
+        epoch_begin = std::chrono::high_resolution_clock::now();
         };
     nn.initialize_training();
     bool terminated = false;
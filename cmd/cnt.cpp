@@ -104,6 +104,15 @@ int cnt(void)
     vbc->ui->track_trimming->setValue(po.get("trim",1));
     std::cout << "trim=" << vbc->ui->track_trimming->value() << std::endl;
 
+    // --fast_null=1 requires --trim=0 and no region. Otherwise fiber tracking is used.
+    if(po.get("fast_null",int(0)))
+    {
+        std::cout << "tracking-free null distribution" << std::endl;
+        if(vbc->ui->track_trimming->value())
+            std::cout << "--fast_null=1 requires --trim=0. The default trim=1 falls back to fiber tracking." << std::endl;
+        vbc->ui->fast_null->setChecked(true);
+    }
+
 
     if(po.get("normalized_qa",int(0)))
     {
@@ -11,6 +11,8 @@
 #include "libs/gzip_interface.hpp"
 #include "program_option.hpp"
 
+extern bool use_fib_cache;
+std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name,bool exclusive = false);
 // test example
 
 int exp(void)
@@ -35,19 +37,31 @@ int exp(void)
         return 1;
     }
 
-    gz_mat_read mat_reader;
+    gz_mat_read local_reader;
+    gz_mat_read* reader = &local_reader;
+    std::shared_ptr<fib_data> resident;
     std::string file_name = po.get("source");
-    std::cout << "loading " << file_name << "..." <<std::endl;
-    if(!QFileInfo(file_name.c_str()).exists())
+    if(use_fib_cache && QString(file_name.c_str()).endsWith("fib.gz"))
     {
-        std::cout << file_name << " does not exist. terminating..." << std::endl;
-        return 0;
+        if(!(resident = cmd_load_fib(file_name)).get())
+            return 0;
+        reader = &resident->mat_reader;
     }
-    if (!mat_reader.load_from_file(file_name.c_str()))
+    else
     {
-        std::cout << "Invalid file format" << std::endl;
-        return 0;
+        std::cout << "loading " << file_name << "..." <<std::endl;
+        if(!QFileInfo(file_name.c_str()).exists())
+        {
+            std::cout << file_name << " does not exist. terminating..." << std::endl;
+            return 0;
+        }
+        if (!local_reader.load_from_file(file_name.c_str()))
+        {
+            std::cout << "Invalid file format" << std::endl;
+            return 0;
+        }
     }
+    gz_mat_read& mat_reader = *reader;
 
     unsigned int col,row;
     const unsigned short* dim_buf = 0;
@@ -0,0 +1,57 @@
+#ifndef JOB_OUTPUT_HPP
+#define JOB_OUTPUT_HPP
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <mutex>
+
+// redirects std::cout of a job thread into its own log so concurrent jobs do not interleave
+extern thread_local std::ostringstream* job_log;
+class job_output_buf : public std::streambuf{
+    std::streambuf* console;
+public:
+    std::mutex lock;
+    job_output_buf(std::streambuf* console_):console(console_){}
+    void write_console(const std::string& str)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        console->sputn(str.c_str(),str.length());
+        console->pubsync();
+    }
+protected:
+    virtual int overflow(int c)
+    {
+        if(c == EOF)
+            return 0;
+        if(job_log)
+            job_log->put(char(c));
+        else
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            console->sputc(char(c));
+        }
+        return c;
+    }
+    virtual std::streamsize xsputn(const char* s,std::streamsize n)
+    {
+        if(job_log)
+            job_log->write(s,n);
+        else
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            console->sputn(s,n);
+        }
+        return n;
+    }
+    virtual int sync(void)
+    {
+        if(!job_log)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            console->pubsync();
+        }
+        return 0;
+    }
+};
+
+#endif//JOB_OUTPUT_HPP
@@ -1,67 +1,185 @@
 #include <QString>
 #include <QStringList>
 #include <QFileInfo>
+#include <QDir>
+#include <fstream>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include "program_option.hpp"
 #include "libs/dsi/image_model.hpp"
 
 QStringList search_files(QString dir,QString filter);
 
+struct src_qc_result{
+    bool loaded = false;
+    tipl::vector<3,int> dim;
+    tipl::vector<3> vs;
+    int dwi_count = 0;
+    float max_b = 0.0f;
+    float corr = 0.0f;
+    size_t memory = 0; // bytes of the loaded DWI
+};
 
-std::string quality_check_src_files(QString dir)
+void get_src_qc(const QString& file_name,src_qc_result& result)
+{
+    ImageModel handle;
+    if (!handle.load_from_file(file_name.toStdString().c_str()) || handle.src_bvalues.empty())
+        return;
+    result.loaded = true;
+    result.dim = tipl::vector<3,int>(handle.voxel.dim.begin());
+    result.vs = handle.voxel.vs;
+    result.dwi_count = handle.src_bvalues.size();
+    result.max_b = *std::max_element(handle.src_bvalues.begin(),handle.src_bvalues.end());
+    result.corr = handle.quality_control_neighboring_dwi_corr();
+    result.memory = handle.voxel.dim.size()*handle.src_bvalues.size()*sizeof(unsigned short);
+}
+
+void output_src_qc(std::ostream& out,const std::string& name,const src_qc_result& result,const src_qc_result& ref)
+{
+    out << name << "\t";
+    if(!result.loaded)
+    {
+        out << "Cannot load SRC file"  << std::endl;
+        return;
+    }
+    out << result.dim << "\t";
+    out << result.vs << "\t";
+    out << result.dwi_count << "\t";
+    out << result.max_b << "\t";
+    // check shell structure against the first file
+    out << (ref.max_b == result.max_b && ref.dwi_count == result.dwi_count ? "Yes\t" : "No\t");
+    out << result.corr << "\t";
+    out << std::endl;
+}
+
+/**
+ quality check of all SRC files in dir. Files are loaded by concurrent workers,
+ and each row is written to out and flushed as soon as the file is checked, so
+ the row order follows completion. Files are named by their paths relative to dir,
+ which stay distinct when subjects share a file name, and files named in done are skipped.
+ memory_budget limits the number of concurrent workers by the size of the first SRC file (0: no limit).
+ */
+void quality_check_src_files(QString dir,std::ostream& out,bool output_header,
+                             unsigned int thread_count,size_t memory_budget,
+                             const std::set<std::string>& done)
 {
-    std::ostringstream out;
     QStringList filenames = search_files(dir,"*src.gz");
-    out << "FileName\tImage dimension\tResolution\tDWI count\tMax b-value\tB-table matched\tNeighboring DWI correlation" << std::endl;
-    int dwi_count = 0;
-    float max_b = 0;
-    for(int i = 0;check_prog(i,filenames.size());++i)
+    if(output_header)
+        out << "FileName\tImage dimension\tResolution\tDWI count\tMax b-value\tB-table matched\tNeighboring DWI correlation" << std::endl;
+    if(filenames.empty())
+        return;
+    std::vector<std::string> names(filenames.size());
+    for(int i = 0;i < filenames.size();++i)
+        names[i] = QDir(dir).relativeFilePath(filenames[i]).toStdString();
+    prog_context context(current_prog());
+    // the first file is the reference for the b-table check
+    src_qc_result ref;
     {
-        out << QFileInfo(filenames[i]).baseName().toStdString() << "\t";
-        ImageModel handle;
-        unique_prog(true);
-        if (!handle.load_from_file(filenames[i].toStdString().c_str()))
-        {
-            out << "Cannot load SRC file"  << std::endl;
-            continue;
-        }
-        unique_prog(false);
-        // output image dimension
-        out << tipl::vector<3,int>(handle.voxel.dim.begin()) << "\t";
-        // output image resolution
-        out << handle.voxel.vs << "\t";
-        // output DWI count
-        int cur_dwi_count = 0;
-        out << (cur_dwi_count = handle.src_bvalues.size()) << "\t";
-        if(i == 0)
-            dwi_count = cur_dwi_count;
+        prog_scope scope(&context);
+        get_src_qc(filenames[0],ref);
+    }
+    if(!done.count(names[0]))
+        output_src_qc(out,names[0],ref,ref);
 
-        // output max_b
-        float cur_max_b = 0;
-        out << (cur_max_b = *std::max_element(handle.src_bvalues.begin(),handle.src_bvalues.end())) << "\t";
-        if(i == 0)
-            max_b = cur_max_b;
-        // check shell structure
-        out << (max_b == cur_max_b && cur_dwi_count == dwi_count ? "Yes\t" : "No\t");
+    std::vector<int> jobs;
+    for(int i = 1;i < filenames.size();++i)
+        if(!done.count(names[i]))
+            jobs.push_back(i);
 
-        // calculate neighboring DWI correlation
-        out << handle.quality_control_neighboring_dwi_corr() << "\t";
+    thread_count = std::max<unsigned int>(1,thread_count);
+    // the loaded DWI and its working copies take about twice the raw size
+    if(memory_budget && ref.memory)
+        thread_count = std::max<size_t>(1,std::min<size_t>(thread_count,memory_budget/(ref.memory*2)));
+    thread_count = std::min<size_t>(thread_count,std::max<size_t>(1,jobs.size()));
 
-        out << std::endl;
+    std::mutex output_lock;
+    std::atomic<unsigned int> next_job(0),finished(0);
+    std::vector<std::thread> workers;
+    for(unsigned int id = 0;id < thread_count;++id)
+        workers.push_back(std::thread([&]()
+        {
+            prog_context worker_prog(&context);
+            prog_scope scope(&worker_prog);
+            for(unsigned int job;(job = next_job++) < jobs.size() && !context.aborted();++finished)
+            {
+                src_qc_result result;
+                try{
+                    get_src_qc(filenames[jobs[job]],result);
+                }
+                catch(...){} // reported as not loaded
+                if(context.aborted())
+                    break;
+                std::lock_guard<std::mutex> lock(output_lock);
+                output_src_qc(out,names[jobs[job]],result,ref);
+                out.flush();
+            }
+        }));
+    while(finished < jobs.size() && !context.aborted())
+    {
+        if(!check_prog(finished,jobs.size()))
+            context.abort();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
+    for(unsigned int i = 0;i < workers.size();++i)
+        workers[i].join();
+    check_prog(jobs.size(),jobs.size());
+}
+
+std::string quality_check_src_files(QString dir)
+{
+    std::ostringstream out;
+    quality_check_src_files(dir,out,true,std::thread::hardware_concurrency(),0,std::set<std::string>());
     return out.str();
 }
 
 /**
- perform reconstruction
+ quality check of SRC files in a directory
+ --thread_count: number of files checked concurrently
+ --memory_budget: memory limit in MB for the loaded SRC files (0: no limit)
+ --output: report file (default: src_report.txt in the directory). An existing report
+           is resumed: files already listed are skipped and new rows are appended.
  */
 int qc(void)
 {
-    std::string file_name = po.get("source");
-    if(QFileInfo(file_name.c_str()).isDir())
+    std::string dir = po.get("source");
+    if(!QFileInfo(dir.c_str()).isDir())
+    {
+        std::cout << dir << " is not a directory" << std::endl;
+        return 1;
+    }
+    std::string file_name = po.get("output",(dir + "/src_report.txt").c_str());
+    std::set<std::string> done;
+    bool incomplete_line = false;
     {
-        file_name += "\\src_report.txt";
-        std::ofstream out(file_name.c_str());
-        out << quality_check_src_files(file_name.c_str());
+        std::ifstream in(file_name.c_str());
+        std::string line;
+        // skip the header
+        if(std::getline(in,line))
+            while(std::getline(in,line))
+            {
+                // the last row may be cut off by a crash and is checked again
+                incomplete_line = in.eof();
+                if(!incomplete_line && line.find('\t') != std::string::npos)
+                    done.insert(line.substr(0,line.find('\t')));
+            }
     }
+    bool resume = QFileInfo(file_name.c_str()).exists();
+    if(resume)
+        std::cout << "resume " << file_name << " with " << done.size() << " files checked" << std::endl;
+    std::ofstream out(file_name.c_str(),resume ? std::ios::app : std::ios::out);
+    if(!out)
+    {
+        std::cout << "cannot write to " << file_name << std::endl;
+        return 1;
+    }
+    if(incomplete_line)
+        out << std::endl;
+    begin_prog("checking SRC files");
+    quality_check_src_files(dir.c_str(),out,!resume,
+                            po.get("thread_count",int(std::thread::hardware_concurrency())),
+                            size_t(po.get("memory_budget",0))*1024*1024,done);
     return 0;
 }
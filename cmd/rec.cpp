@@ -1,14 +1,23 @@
 #include <QString>
 #include <QFileInfo>
+#include <QDir>
 #include <iostream>
+#include <fstream>
 #include <iterator>
 #include <string>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
 #include "tipl/tipl.hpp"
 #include "libs/dsi/image_model.hpp"
 #include "mapping/fa_template.hpp"
 #include "libs/gzip_interface.hpp"
 #include "reconstruction/reconstruction_window.h"
 #include "program_option.hpp"
+#include "job_output.hpp"
 
 extern fa_template fa_template_imp;
 extern std::vector<std::string> fa_template_list;
@@ -17,12 +26,13 @@ void calculate_shell(const std::vector<float>& bvalues,std::vector<unsigned int>
 bool is_dsi_half_sphere(const std::vector<unsigned int>& shell);
 bool is_dsi(const std::vector<unsigned int>& shell);
 bool need_scheme_balance(const std::vector<unsigned int>& shell);
+QStringList search_files(QString dir,QString filter);
 /**
- perform reconstruction
+ perform reconstruction of one SRC file
+ load_template: false if the template is loaded by the caller (batch mode)
  */
-int rec(void)
+int rec_file(const std::string& file_name,bool load_template)
 {
-    std::string file_name = po.get("source");
     std::cout << "loading source..." <<std::endl;
     std::auto_ptr<ImageModel> handle(new ImageModel);
     if (!handle->load_from_file(file_name.c_str()))
@@ -145,6 +155,7 @@ int rec(void)
     handle->voxel.output_mapping = po.get("output_map",int(0));
     handle->voxel.output_diffusivity = po.get("output_dif",int(1));
     handle->voxel.output_tensor = po.get("output_tensor",int(0));
+    handle->voxel.dti_wls = po.get("dti_wls",int(0));
     handle->voxel.output_rdi = po.get("output_rdi",int(1)) && (method_index == 4 || method_index == 7);
     handle->voxel.odf_deconvolusion = po.get("deconvolution",int(0));
     handle->voxel.odf_decomposition = po.get("decomposition",int(0));
@@ -169,7 +180,7 @@ int rec(void)
         }
         handle->voxel.external_template = template_file_name;
     }
-    if(!fa_template_imp.load_from_file())
+    if(load_template && !fa_template_imp.load_from_file())
     {
         std::cout << fa_template_imp.error_msg << std::endl;
         return -1;
@@ -255,6 +266,160 @@ int rec(void)
     if (!msg)
         std::cout << "Reconstruction finished." << std::endl;
     else
+    {
         std::cout << msg << std::endl;
+        return 1;
+    }
     return 0;
 }
+
+/**
+ runs several subjects at the same time so that one subject's loading and
+ normalization overlap with another subject's reconstruction.
+ --job_count: subjects processed concurrently, sharing --thread_count threads
+ --memory_budget: memory limit in MB. A subject is estimated to need 4 times its SRC file size.
+ --report: status and timing of each subject (default: rec_report.txt in the source directory).
+           An existing report is resumed, and only subjects not finished successfully are run.
+ */
+int rec_batch(const std::vector<std::string>& file_list,const std::string& report_file)
+{
+    unsigned int thread_count = std::max<int>(1,po.get("thread_count",int(std::thread::hardware_concurrency())));
+    unsigned int job_count = std::max<int>(1,po.get("job_count",int(std::max<unsigned int>(1,thread_count/4))));
+    size_t memory_budget = size_t(po.get("memory_budget",0))*1024*1024;
+
+    std::set<std::string> finished_files;
+    bool resume = QFileInfo(report_file.c_str()).exists();
+    {
+        std::ifstream in(report_file.c_str());
+        std::string line;
+        while(std::getline(in,line))
+        {
+            std::istringstream in2(line);
+            std::string name,status;
+            if(std::getline(in2,name,'\t') && std::getline(in2,status,'\t') && status == "ok")
+                finished_files.insert(name);
+        }
+    }
+    std::vector<std::string> jobs;
+    for(unsigned int i = 0;i < file_list.size();++i)
+        if(!finished_files.count(file_list[i]))
+            jobs.push_back(file_list[i]);
+    std::cout << jobs.size() << " of " << file_list.size() << " subjects to reconstruct with "
+              << job_count << " concurrent jobs" << std::endl;
+    if(jobs.empty())
+        return 0;
+    if(!fa_template_imp.load_from_file())
+    {
+        std::cout << fa_template_imp.error_msg << std::endl;
+        return -1;
+    }
+    std::ofstream report(report_file.c_str(),resume ? std::ios::app : std::ios::out);
+    if(!resume)
+        report << "FileName\tStatus\tTime(s)" << std::endl;
+
+    std::streambuf* console = std::cout.rdbuf();
+    job_output_buf output(console);
+    std::cout.rdbuf(&output);
+
+    program_option job_po = po;
+    job_po.set("thread_count",std::max<unsigned int>(1,thread_count/job_count));
+    std::mutex lock;
+    std::condition_variable memory_released;
+    size_t memory_used = 0;
+    unsigned int running = 0;
+    std::atomic<unsigned int> next_job(0);
+    unsigned int failed = 0;
+    std::vector<std::thread> workers;
+    for(unsigned int id = 0;id < std::min<size_t>(job_count,jobs.size());++id)
+        workers.push_back(std::thread([&]()
+        {
+            // the workers share job_po read-only. Threads started inside rec_file still read the global po.
+            program_option_scope po_scope(&job_po);
+            for(unsigned int job;(job = next_job++) < jobs.size();)
+            {
+                size_t memory = size_t(QFileInfo(jobs[job].c_str()).size())*4;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    // always let one job run even if it exceeds the budget
+                    memory_released.wait(guard,[&](){return !memory_budget || !running || memory_used+memory <= memory_budget;});
+                    memory_used += memory;
+                    ++running;
+                }
+                output.write_console(jobs[job] + "\tstarted\n");
+                std::ostringstream log;
+                job_log = &log;
+                int result = 1;
+                auto t0 = std::chrono::high_resolution_clock::now();
+                try{
+                    prog_context context;
+                    prog_scope scope(&context);
+                    result = rec_file(jobs[job],false);
+                }
+                catch(const std::exception& e)
+                {
+                    std::cout << e.what() << std::endl;
+                }
+                catch(...)
+                {
+                    std::cout << "unknown error occured" << std::endl;
+                }
+                std::cout.flush();
+                job_log = 0;
+                double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+                std::ostringstream out;
+                std::istringstream in(log.str());
+                std::string line;
+                while(std::getline(in,line))
+                    out << QFileInfo(jobs[job].c_str()).baseName().toStdString() << "\t" << line << std::endl;
+                output.write_console(out.str());
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    memory_used -= memory;
+                    --running;
+                    if(result)
+                        ++failed;
+                    report << jobs[job] << "\t" << (result ? "failed" : "ok") << "\t" << sec << std::endl;
+                    memory_released.notify_all();
+                }
+            }
+        }));
+    for(unsigned int i = 0;i < workers.size();++i)
+        workers[i].join();
+    std::cout.rdbuf(console);
+    std::cout << jobs.size()-failed << " subjects finished, " << failed << " failed. See " << report_file << std::endl;
+    return failed ? 1 : 0;
+}
+
+/**
+ perform reconstruction
+ --source: a SRC file, a directory of SRC files, or a wildcard such as *.src.gz
+ */
+int rec(void)
+{
+    std::string source = po.get("source");
+    QFileInfo source_info(source.c_str());
+    std::vector<std::string> file_list;
+    if(source_info.isDir())
+    {
+        QStringList files = search_files(source.c_str(),"*src.gz");
+        for(int i = 0;i < files.size();++i)
+            file_list.push_back(files[i].toStdString());
+    }
+    else
+    if(source.find('*') != std::string::npos)
+    {
+        QDir dir(source_info.absolutePath());
+        QStringList files = dir.entryList(QStringList(source_info.fileName()),QDir::Files|QDir::NoSymLinks,QDir::Name);
+        for(int i = 0;i < files.size();++i)
+            file_list.push_back((dir.absolutePath() + "/" + files[i]).toStdString());
+    }
+    else
+        return rec_file(source,true);
+    if(file_list.empty())
+    {
+        std::cout << "no SRC file found at " << source << std::endl;
+        return 1;
+    }
+    std::string report_dir = source_info.isDir() ? source : source_info.absolutePath().toStdString();
+    return rec_batch(file_list,po.get("report",(report_dir + "/rec_report.txt").c_str()));
+}
@@ -0,0 +1,245 @@
+#include <QFileInfo>
+#include <QDateTime>
+#include <QStringList>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include "tipl/tipl.hpp"
+#include "program_option.hpp"
+#include "atlas.hpp"
+#include "prog_interface_static_link.h"
+#include "job_output.hpp"
+
+extern bool use_fib_cache;
+extern std::vector<atlas> atlas_list;
+extern thread_local bool atlas_list_read_only;
+bool atl_load_atlas(std::string atlas_name);
+int trk(void);
+int ana(void);
+int exp(void);
+
+thread_local std::ostringstream* job_log = 0;
+
+struct server_job{
+    std::string id,command;
+};
+
+class job_server{
+    std::deque<server_job> jobs;
+    unsigned int running = 0;
+    bool ended = false;
+    std::mutex lock;
+    std::condition_variable job_added,job_done;
+    std::map<std::string,QDateTime> atlas_time;
+    job_output_buf& output;
+public:
+    job_server(job_output_buf& output_):output(output_){}
+    void add(const server_job& job)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(job);
+        job_added.notify_one();
+    }
+    void wait_all(void)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        job_done.wait(guard,[&](){return jobs.empty() && running == 0;});
+    }
+    void end(void)
+    {
+        wait_all();
+        std::lock_guard<std::mutex> guard(lock);
+        ended = true;
+        job_added.notify_all();
+    }
+    // atlases are loaded lazily and atlas_list may grow, so new or modified atlases
+    // are loaded only when no job is running
+    void prepare_atlas(const std::string& command)
+    {
+        std::set<std::string> names;
+        std::istringstream in(command);
+        std::string token;
+        while(in >> token)
+        {
+            auto pos = token.find('=');
+            if(pos == std::string::npos || token.length() < 3 || token[0] != '-' || token[1] != '-')
+                continue;
+            std::string key = token.substr(2,pos-2),value = token.substr(pos+1);
+            QStringList value_list = QString(value.c_str()).split(",");
+            if(key == "atlas")
+            {
+                for(int i = 0;i < value_list.size();++i)
+                    names.insert(value_list[i].toStdString());
+                continue;
+            }
+            if(key == "connectivity")
+            {
+                for(int i = 0;i < value_list.size();++i)
+                    if(!QFileInfo(value_list[i]).exists())
+                        names.insert(value_list[i].toStdString());
+                continue;
+            }
+            // atlas region such as --roi=aal:Precentral_L
+            std::string region = value_list[0].toStdString();
+            if(region.find(':') != std::string::npos && region.find(':') != 1)
+                names.insert(region.substr(0,region.find(':')));
+        }
+        for(auto& name : names)
+        {
+            bool loaded = false;
+            for(unsigned int i = 0;i < atlas_list.size();++i)
+                if(atlas_list[i].name == name || atlas_list[i].filename == name)
+                {
+                    loaded = (QFileInfo(atlas_list[i].filename.c_str()).lastModified() == atlas_time[atlas_list[i].filename]);
+                    if(!loaded)
+                    {
+                        wait_all();
+                        atlas_list.erase(atlas_list.begin()+i);
+                    }
+                    break;
+                }
+            if(loaded)
+                continue;
+            wait_all();
+            if(!atl_load_atlas(name))
+                continue;
+            for(unsigned int i = 0;i < atlas_list.size();++i)
+                if(atlas_list[i].name == name || atlas_list[i].filename == name)
+                {
+                    // this loads the image so that jobs only read the atlas
+                    atlas_list[i].load();
+                    atlas_time[atlas_list[i].filename] = QFileInfo(atlas_list[i].filename.c_str()).lastModified();
+                }
+        }
+    }
+    void run_worker(void)
+    {
+        while(1)
+        {
+            server_job job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                job_added.wait(guard,[&](){return ended || !jobs.empty();});
+                if(jobs.empty())
+                    return;
+                job = jobs.front();
+                jobs.pop_front();
+                ++running;
+            }
+            output.write_console(job.id + "\tstarted\n");
+            std::ostringstream log;
+            job_log = &log;
+            int result = 1;
+            auto t0 = std::chrono::high_resolution_clock::now();
+            try{
+                prog_context context;
+                prog_scope scope(&context);
+                program_option job_po;
+                job_po.init(job.command);
+                program_option_scope po_scope(&job_po);
+                atlas_list_read_only = true;
+                std::string action = po.get("action");
+                if(!po.has("source"))
+                    std::cout << "no source assigned" << std::endl;
+                else
+                if(action == "trk")
+                    result = trk();
+                else
+                if(action == "ana")
+                    result = ana();
+                else
+                if(action == "exp")
+                    result = exp();
+                else
+                    std::cout << "Unsupported server action:" << action << std::endl;
+            }
+            catch(const std::exception& e)
+            {
+                std::cout << e.what() << std::endl;
+            }
+            catch(...)
+            {
+                std::cout << "unknown error occured" << std::endl;
+            }
+            atlas_list_read_only = false;
+            std::cout.flush();
+            job_log = 0;
+            double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+            std::ostringstream out;
+            std::istringstream in(log.str());
+            std::string line;
+            while(std::getline(in,line))
+                out << job.id << "\t" << line << std::endl;
+            out << job.id << "\tfinished\t" << result << "\t" << sec << " sec" << std::endl;
+            output.write_console(out.str());
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                --running;
+                job_done.notify_all();
+            }
+        }
+    }
+};
+
+/**
+ persistent server mode. Each line from stdin is one job with the same options as the command line, e.g.
+ --action=trk --source=subject.fib.gz --roi=roi.nii.gz --output=out.trk.gz
+ Loaded fib files and atlases stay resident and are reloaded only when the files are modified.
+ "wait" blocks until all submitted jobs are done, and "quit" or end of input stops the server.
+ Results are streamed back prefixed with the job id (--job_id=, or the line number by default).
+ Relative paths are resolved against the working directory of the server.
+ Jobs share a resident fib file read-only. Jobs that modify it (--threshold_index, --connectometry_source) get their own copy.
+ Jobs cannot add to the atlas list: atlases named in a job are loaded before it starts,
+ and an MNI space ROI file used in --connectivity is loaded for that job only.
+ */
+int server(void)
+{
+    unsigned int job_count = std::max<int>(1,po.get("job_count",4));
+    use_fib_cache = true;
+    std::streambuf* console = std::cout.rdbuf();
+    job_output_buf output(console);
+    std::cout.rdbuf(&output);
+    std::cout << "server ready with " << job_count << " concurrent jobs" << std::endl;
+    job_server server(output);
+    std::vector<std::thread> workers;
+    for(unsigned int i = 0;i < job_count;++i)
+        workers.push_back(std::thread([&](){server.run_worker();}));
+
+    std::string line;
+    for(unsigned int line_count = 1;std::getline(std::cin,line);++line_count)
+    {
+        if(line.empty() || line[0] == '#')
+            continue;
+        if(line == "quit" || line == "exit")
+            break;
+        if(line == "wait")
+        {
+            server.wait_all();
+            std::cout << "all jobs finished" << std::endl;
+            continue;
+        }
+        server_job job;
+        job.command = line;
+        {
+            program_option job_po;
+            job_po.init(line);
+            std::ostringstream out;
+            out << line_count;
+            job.id = job_po.get("job_id",out.str().c_str());
+        }
+        server.prepare_atlas(line);
+        server.add(job);
+    }
+    server.end();
+    for(unsigned int i = 0;i < workers.size();++i)
+        workers[i].join();
+    std::cout.rdbuf(console);
+    return 0;
+}
@@ -1,6 +1,10 @@
 #include <QFileInfo>
 #include <QStringList>
 #include <QDir>
+#include <QDateTime>
+#include <map>
+#include <mutex>
+#include <chrono>
 #include <iostream>
 #include <iterator>
 #include <string>
@@ -16,6 +20,7 @@
 #include "vbc/vbc_database.h"
 #include "program_option.hpp"
 bool atl_load_atlas(const std::string atlas_name);
+atlas* atl_get_atlas(std::string atlas_name,std::shared_ptr<atlas>& job_atlas);
 void export_track_info(const std::string& file_name,
                        std::string export_option,
                        std::shared_ptr<fib_data> handle,
@@ -126,9 +131,10 @@ void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
                     std::cout << "Cannot output connectivity: no mni mapping" << std::endl;
                     continue;
                 }
-                atlas_list.clear(); // some atlas may be loaded in ROI
-                if(atl_load_atlas(roi_file_name))
-                    data.set_atlas(atlas_list[0],handle->get_mni_mapping());
+                std::shared_ptr<atlas> job_atlas;
+                atlas* roi_atlas = atl_get_atlas(roi_file_name,job_atlas);
+                if(roi_atlas)
+                    data.set_atlas(*roi_atlas,handle->get_mni_mapping());
                 else
                 {
                     std::cout << "File or atlas does not exist:" << roi_file_name << std::endl;
@@ -191,8 +197,36 @@ void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
 // test example
 // --action=trk --source=./test/20100129_F026Y_WANFANGYUN.src.gz.odf8.f3rec.de0.dti.fib.gz --method=0 --fiber_count=5000
 
-std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name)
+size_t get_peak_memory_kb(void);
+// resident fib files used by the server mode, keyed by absolute path
+bool use_fib_cache = false;
+std::mutex fib_cache_lock;
+std::map<std::string,std::pair<QDateTime,std::shared_ptr<fib_data> > > fib_cache;
+
+// exclusive: the caller modifies the fib data and needs its own copy
+std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name,bool exclusive = false)
 {
+    if(use_fib_cache && !exclusive && QFileInfo(file_name.c_str()).exists())
+    {
+        std::string path = QFileInfo(file_name.c_str()).absoluteFilePath().toStdString();
+        QDateTime modified = QFileInfo(file_name.c_str()).lastModified();
+        {
+            std::lock_guard<std::mutex> lock(fib_cache_lock);
+            auto iter = fib_cache.find(path);
+            if(iter != fib_cache.end() && iter->second.first == modified)
+            {
+                std::cout << "using resident " << file_name << std::endl;
+                return iter->second.second;
+            }
+        }
+        std::shared_ptr<fib_data> handle = cmd_load_fib(file_name,true);
+        if(handle.get())
+        {
+            std::lock_guard<std::mutex> lock(fib_cache_lock);
+            fib_cache[path] = std::make_pair(modified,handle);
+        }
+        return handle;
+    }
     std::shared_ptr<fib_data> handle(new fib_data);
     std::cout << "loading " << file_name << "..." <<std::endl;
     if(!QFileInfo(file_name.c_str()).exists())
@@ -200,12 +234,16 @@ std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name)
         std::cout << file_name << " does not exist. terminating..." << std::endl;
         return std::shared_ptr<fib_data>();
     }
+    auto t0 = std::chrono::high_resolution_clock::now();
     if (!handle->load_from_file(file_name.c_str()))
     {
         std::cout << "Open file " << file_name << " failed" << std::endl;
         std::cout << "msg:" << handle->error_msg << std::endl;
         return std::shared_ptr<fib_data>();
     }
+    std::cout << "opened in " << std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count()
+              << " seconds with " << handle->view_item.size() << " metrics, peak memory "
+              << (get_peak_memory_kb() >> 10) << " MB" << std::endl;
     return handle;
 }
 
@@ -418,7 +456,8 @@ int trk(void)
 {
     try{
 
-    std::shared_ptr<fib_data> handle = cmd_load_fib(po.get("source"));
+    std::shared_ptr<fib_data> handle = cmd_load_fib(po.get("source"),
+                    po.has("threshold_index") || po.has("connectometry_source"));
     if(!handle.get())
         return 0;
     if (po.has("threshold_index"))
@@ -2,6 +2,8 @@
 #include <QStringListModel>
 #include <QMessageBox>
 #include <fstream>
+#include <sstream>
+#include <thread>
 #include "createdbdialog.h"
 #include "ui_createdbdialog.h"
 #include "fib_data.hpp"
@@ -282,23 +284,34 @@ void CreateDBDialog::on_create_data_base_clicked()
 
         data->handle->db.index_name = ui->index_of_interest->currentText().toLower().toStdString();
 
+        std::vector<std::string> file_list,subject_names;
         for (unsigned int index = 0;index < group.count();++index)
         {
-            begin_prog(QFileInfo(group[index]).baseName().toStdString().c_str());
-            if(!data->handle->db.add_subject_file(group[index].toStdString(),get_file_name(group[index]).toStdString()))
-            {
+            file_list.push_back(group[index].toStdString());
+            subject_names.push_back(get_file_name(group[index]).toStdString());
+        }
+        begin_prog("loading subject fib files");
+        std::ostringstream log;
+        if(!data->handle->db.add_subject_files(file_list,subject_names,std::thread::hardware_concurrency(),0,log))
+        {
+            if(!prog_aborted())
                 QMessageBox::information(this,"error in loading subject fib files",data->handle->error_msg.c_str(),0);
-                check_prog(0,0);
-                return;
-            }
-            if(prog_aborted())
-            {
-                check_prog(0,0);
-                return;
-            }
+            return;
         }
         data->handle->db.save_subject_data(ui->output_file_name->text().toStdString().c_str());
-        QMessageBox::information(this,"completed","Connectometry database created",0);
+        if(data->handle->db.num_subjects < file_list.size())
+        {
+            // list the subjects that failed to load or failed the consistency check
+            std::istringstream in(log.str());
+            std::string line,failed_list;
+            while(std::getline(in,line))
+                if(line.find("\tfailed\t") != std::string::npos)
+                    failed_list += line.substr(line.find("\tfailed\t")+8) + "\n";
+            QMessageBox::information(this,"completed","Connectometry database created without the following subjects:\n" +
+                                     QString(failed_list.c_str()),0);
+        }
+        else
+            QMessageBox::information(this,"completed","Connectometry database created",0);
     }
     else
     {
@@ -132,7 +132,7 @@ void db_window::update_subject_list()
 void db_window::on_subject_list_itemSelectionChanged()
 {
     if(ui->subject_list->currentRow() == -1 ||
-            ui->subject_list->currentRow() >= vbc->handle->db.subject_qa.size())
+            ui->subject_list->currentRow() >= vbc->handle->db.num_subjects)
         return;
     if(ui->view_x->isChecked())
         ui->x_pos->setValue(ui->slice_pos->value());
@@ -763,6 +763,8 @@ void group_connectometry::on_run_clicked()
     ui->span_to->setValue(80);
     vbc->seed_ratio = ui->seed_ratio->value();
     vbc->trk_file_names = file_names;
+    // completed permutations are saved and resumed when the same analysis is run again
+    vbc->checkpoint_file = file_names.empty() ? std::string() : file_names[0] + ".permutation.mat";
     vbc->normalize_qa = ui->normalize_qa->isChecked();
     vbc->output_resampling = ui->output_resampling->isChecked();
     if(ui->rb_fdr->isChecked())
@@ -874,6 +876,19 @@ void group_connectometry::on_run_clicked()
     if(vbc->track_trimming)
         out << " Track trimming was conducted with " << vbc->track_trimming << " iterations.";
 
+    vbc->fast_null = ui->fast_null->isChecked();
+    if(vbc->fast_null && (!vbc->roi_list.empty() || vbc->track_trimming))
+    {
+        const char* msg = "The tracking-free null distribution does not apply regions or track trimming. Set track trimming to 0 and remove the regions to use it. Fiber tracking is used instead.";
+        if(gui)
+            QMessageBox::information(this,"Warning",msg);
+        else
+            std::cout << msg << std::endl;
+        vbc->fast_null = false;
+    }
+    if(vbc->fast_null)
+        out << " The track length distributions were estimated from the connected components of the selected local connectomes without fiber tracking.";
+
     if(vbc->output_resampling)
         out << " All tracks generated from bootstrap resampling were included.";
 
@@ -9,8 +9,32 @@
 #include "prog_interface_static_link.h"
 #include "libs/gzip_interface.hpp"
 #include "motion_dialog.hpp"
+#include <atomic>
+#include <thread>
 
 
+// decodes files concurrently in blocks so that only a few files per thread are in memory at once.
+// fun(index) returns false to stop loading, and the output order is decided by the index.
+// returns false if any file fails or the user aborts
+template<class fun_type>
+bool par_for_files(unsigned int file_count,fun_type&& fun)
+{
+    const unsigned int block_size = std::max<unsigned int>(1,std::thread::hardware_concurrency())*4;
+    std::atomic<bool> failed(false);
+    for(unsigned int from = 0;check_prog(from,file_count) && !failed;from += block_size)
+    {
+        unsigned int size = std::min<unsigned int>(block_size,file_count-from);
+        tipl::par_for(size,[&](unsigned int i)
+        {
+            if(!failed && !fun(from+i))
+                failed = true;
+        });
+    }
+    if(prog_aborted())
+        return false;
+    check_prog(file_count,file_count);
+    return !failed;
+}
 
 void get_report_from_dicom(const tipl::io::dicom& header,std::string& report_);
 void get_report_from_bruker(const tipl::io::bruker_info& header,std::string& report_);
@@ -138,7 +162,8 @@ bool load_dicom_multi_frame(const char* file_name,std::vector<std::shared_ptr<Dw
     unsigned int plane_size = buf_image.width()*buf_image.height();
     b_table.resize(num_gradient*4);
     begin_prog("loading multi frame DICOM");
-    for(unsigned int index = 0;check_prog(index,num_gradient);++index)
+    std::vector<std::shared_ptr<DwiHeader> > new_files(num_gradient);
+    if(!par_for_files(num_gradient,[&](unsigned int index)
     {
         std::shared_ptr<DwiHeader> new_file(new DwiHeader);
         if(index == 0)
@@ -156,8 +181,11 @@ bool load_dicom_multi_frame(const char* file_name,std::vector<std::shared_ptr<Dw
         dicom_header.get_voxel_size(new_file->voxel_size);
         new_file->bvalue = b_table[index*4];
         new_file->bvec = tipl::vector<3, float>(b_table[index*4+1],b_table[index*4+2],b_table[index*4+3]);
-        dwi_files.push_back(new_file);
-    }
+        new_files[index] = new_file;
+        return true;
+    }))
+        return false;
+    dwi_files.insert(dwi_files.end(),new_files.begin(),new_files.end());
     return true;
 }
 
@@ -501,55 +529,37 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
         }
     }
 
-    if(iterate_slice_first)
+    // each file goes to a fixed dwi and slice, so slices can be decoded in any order
+    unsigned int dwi_num = iterate_slice_first ? (file_list.size()+slice_num-1)/slice_num : b_num;
+    std::vector<std::shared_ptr<DwiHeader> > new_files(dwi_num);
+    begin_prog("loading images");
+    // the first file of each dwi provides the b-table and the header information
+    if(!par_for_files(dwi_num,[&](unsigned int b_index)
     {
-        for (unsigned int index = 0,b_index = 0,slice_index = 0;check_prog(index,file_list.size());++index)
-        {
-            if(!dicom_header2.load_from_file(file_list[index].toLocal8Bit().begin()))
-                return false;
-            if(slice_index == 0)
-            {
-                dwi_files.push_back(std::make_shared<DwiHeader>());
-                dwi_files.back()->open(file_list[index].toLocal8Bit().begin());
-                dwi_files.back()->file_name = file_list[index].toLocal8Bit().begin();
-                dwi_files.back()->image.resize(geo);
-                dicom_header.get_voxel_size(dwi_files.back()->voxel_size);
-            }
-            dicom_header2.save_to_buffer(
-                    dwi_files[b_index]->image.begin() + slice_index*geo.plane_size(),geo.plane_size());
-            ++slice_index;
-            if(slice_index >= slice_num)
-            {
-                slice_index = 0;
-                ++b_index;
-            }
-        }
-    }
-    else
+        unsigned int index = iterate_slice_first ? b_index*slice_num : b_index;
+        new_files[b_index] = std::make_shared<DwiHeader>();
+        new_files[b_index]->open(file_list[index].toLocal8Bit().begin());
+        new_files[b_index]->file_name = file_list[index].toLocal8Bit().begin();
+        new_files[b_index]->image.resize(geo);
+        dicom_header.get_voxel_size(new_files[b_index]->voxel_size);
+        return true;
+    }))
+        return false;
+    if(!par_for_files(file_list.size(),[&](unsigned int index)
     {
-        begin_prog("loading images");
-        for (unsigned int index = 0,b_index = 0,slice_index = 0;check_prog(index,file_list.size());++index)
-        {
-            if(!dicom_header2.load_from_file(file_list[index].toLocal8Bit().begin()))
-                return false;
-            if(slice_index == 0)
-            {
-                dwi_files.push_back(std::make_shared<DwiHeader>());
-                dwi_files.back()->open(file_list[index].toLocal8Bit().begin());
-                dwi_files.back()->image.resize(geo);
-                dwi_files.back()->file_name = file_list[index].toLocal8Bit().begin();
-                dicom_header.get_voxel_size(dwi_files.back()->voxel_size);
-            }
-            dicom_header2.save_to_buffer(
-                    dwi_files[b_index]->image.begin() + slice_index*geo.plane_size(),geo.plane_size());
-            ++b_index;
-            if(b_index >= b_num)
-            {
-                b_index = 0;
-                ++slice_index;
-            }
-        }
-    }
+        unsigned int b_index = iterate_slice_first ? index/slice_num : index%b_num;
+        unsigned int slice_index = iterate_slice_first ? index%slice_num : index/b_num;
+        if(slice_index >= geo[2])
+            return true;
+        tipl::io::dicom slice_header;
+        if(!slice_header.load_from_file(file_list[index].toLocal8Bit().begin()))
+            return false;
+        slice_header.save_to_buffer(
+                new_files[b_index]->image.begin() + slice_index*geo.plane_size(),geo.plane_size());
+        return true;
+    }))
+        return false;
+    dwi_files.insert(dwi_files.end(),new_files.begin(),new_files.end());
     return true;
 }
 bool load_4d_fdf(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
@@ -638,14 +648,20 @@ bool load_4d_fdf(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >&
 bool load_3d_series(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
     begin_prog("loading images");
-    for (unsigned int index = 0;check_prog(index,file_list.size());++index)
+    std::vector<std::shared_ptr<DwiHeader> > new_files(file_list.size());
+    par_for_files(file_list.size(),[&](unsigned int index)
     {
         std::shared_ptr<DwiHeader> new_file(new DwiHeader);
         if (!new_file->open(file_list[index].toLocal8Bit().begin()))
-            continue;
+            return true;
         new_file->file_name = file_list[index].toLocal8Bit().begin();
-        dwi_files.push_back(new_file);
-    }
+        new_files[index] = new_file;
+        return true;
+    });
+    // keep the file order so that sort_dwi gives the same result
+    for(unsigned int index = 0;index < new_files.size();++index)
+        if(new_files[index].get())
+            dwi_files.push_back(new_files[index]);
     return !dwi_files.empty();
 }
 
@@ -1,5 +1,7 @@
 #include <sstream>
 #include <string>
+#include <deque>
+#include <future>
 #include "tipl/tipl.hpp"
 #include "dwi_header.hpp"
 #include "gzip_interface.hpp"
@@ -514,38 +516,57 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
 
     //store images
     begin_prog("Save Files");
+    auto resample = [upsampling,geo](const unsigned short* ptr)
+    {
+        tipl::image<unsigned short,3> buffer(geo);
+        std::copy(ptr,ptr+geo.size(),buffer.begin());
+        if(upsampling == 1)
+            tipl::upsampling(buffer);
+        if(upsampling == 2)
+            tipl::downsampling(buffer);
+        if(upsampling == 3)
+        {
+            tipl::upsampling(buffer);
+            tipl::upsampling(buffer);
+        }
+        if(upsampling == 4)
+        {
+            tipl::downsampling(buffer);
+            tipl::downsampling(buffer);
+        }
+        return buffer;
+    };
+    // volumes are resampled ahead by worker threads while this thread writes them in order.
+    // the read-ahead window is limited to about 1 GB of resampled volumes and at most 4 tasks,
+    // because a volume upsampled by 4 is 64 times the original and tipl::upsampling may itself run in parallel
+    const size_t volume_bytes = size_t(output_size)*sizeof(unsigned short);
+    const unsigned int window_size = upsampling ?
+            (unsigned int)std::max<size_t>(1,std::min<size_t>(4,(size_t(1) << 30)/std::max<size_t>(1,volume_bytes))) : 0;
+    std::deque<std::future<tipl::image<unsigned short,3> > > pending;
+    unsigned int next_volume = 0;
     for (unsigned int index = 0;check_prog(index,(unsigned int)(dwi_files.size()));++index)
     {
         std::ostringstream name;
-        tipl::image<unsigned short,3> buffer;
-        const unsigned short* ptr = 0;
         name << "image" << index;
-        ptr = (const unsigned short*)dwi_files[index]->begin();
-        if(upsampling)
+        if(!upsampling)
         {
-            buffer.resize(geo);
-            std::copy(ptr,ptr+geo.size(),buffer.begin());
-            if(upsampling == 1)
-                tipl::upsampling(buffer);
-            if(upsampling == 2)
-                tipl::downsampling(buffer);
-            if(upsampling == 3)
-            {
-                tipl::upsampling(buffer);
-                tipl::upsampling(buffer);
-            }
-            if(upsampling == 4)
-            {
-                tipl::downsampling(buffer);
-                tipl::downsampling(buffer);
-            }
-            ptr = (const unsigned short*)&*buffer.begin();
+            write_mat.write(name.str().c_str(),(const unsigned short*)dwi_files[index]->begin(),1,output_size);
+            continue;
         }
-        write_mat.write(name.str().c_str(),ptr,1,output_size);
+        for(;next_volume < dwi_files.size() && pending.size() < window_size;++next_volume)
+            pending.push_back(std::async(std::launch::async,resample,
+                                         (const unsigned short*)dwi_files[next_volume]->begin()));
+        tipl::image<unsigned short,3> buffer = pending.front().get();
+        pending.pop_front();
+        write_mat.write(name.str().c_str(),&*buffer.begin(),1,output_size);
     }
-
-
-
+    // wait for remaining workers if aborted
+    for(unsigned int i = 0;i < pending.size();++i)
+        pending[i].wait();
+    // an aborted write leaves a truncated src file. Report it as a failure instead of appending the report
+    // and returning true as if all volumes were saved. None of the current callers check the return value.
+    if(prog_aborted())
+        return false;
 
     std::string report1 = dwi_files.front()->report;
     std::string report2;
@@ -4,80 +4,73 @@
 #include "ui_motion_dialog.h"
 #include "dicom_parser.h"
 #include "libs/prog_interface_static_link.h"
+#include <thread>
+#include <numeric>
 
-void linear_reg(const tipl::image<short,3>& from,
+void linear_reg(const tipl::image<unsigned short,3>& from,
                 const tipl::vector<3>& from_vs,
-                const tipl::image<short,3>& to,
+                const tipl::image<unsigned short,3>& to,
                 const tipl::vector<3>& to_vs,
                 tipl::affine_transform<double>& arg,
-                bool& terminated,
-                unsigned int& finished)
+                bool& terminated)
 {
+    // correlation handles the contrast difference between b0 and DWI
     tipl::reg::linear_mr(from,from_vs,to,to_vs,arg,tipl::reg::rigid_body,
-                       tipl::reg::square_error(),terminated);
-    ++finished;
+                       tipl::reg::correlation(),terminated);
 }
 
+// registers every volume to the first b0 with at most thread_count registrations running at a time.
+// reg_time records the time in seconds spent on each volume
 void motion_detection(std::vector<std::shared_ptr<std::future<void> > >& threads,
                       std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
-                      std::vector<unsigned int>& b0_index,
+                      unsigned int& ref_index,
                       std::vector<tipl::affine_transform<double> >& arg,
+                      std::vector<double>& reg_time,
                       bool& terminated,
-                      unsigned int& finished)
+                      std::atomic<unsigned int>& finished,
+                      unsigned int thread_count)
 {
-    b0_index.clear();
+    ref_index = 0;
     for(unsigned int index = 0;index < dwi_files.size();++index)
-    {
         if(dwi_files[index]->get_bvalue() < 100)
-            b0_index.push_back(index);
-    }
+        {
+            ref_index = index;
+            break;
+        }
     arg.clear();
-    arg.resize(b0_index.size());
-
-    for(unsigned int index = 1;index < b0_index.size();++index)
-        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,[&,index](){
-                tipl::vector<3> vs(1,1,1);
-                linear_reg(dwi_files[b0_index[0]]->image,
-                        vs,dwi_files[b0_index[index]]->image,
-                        vs,arg[index],terminated,finished);})));
+    arg.resize(dwi_files.size());
+    reg_time.clear();
+    reg_time.resize(dwi_files.size());
+    finished = 1; // the reference volume
+    auto next_index = std::make_shared<std::atomic<unsigned int> >(0);
+    thread_count = std::max<unsigned int>(1,std::min<unsigned int>(thread_count,dwi_files.size()));
+    for(unsigned int id = 0;id < thread_count;++id)
+        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,[&,next_index,ref_index](){
+            tipl::vector<3> vs(1,1,1);
+            for(unsigned int index;(index = (*next_index)++) < dwi_files.size() && !terminated;)
+            {
+                if(index == ref_index)
+                    continue;
+                auto t0 = std::chrono::high_resolution_clock::now();
+                linear_reg(dwi_files[ref_index]->image,vs,dwi_files[index]->image,vs,arg[index],terminated);
+                reg_time[index] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count();
+                ++finished;
+            }})));
 }
 
 void motion_correction(std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
-                       const std::vector<unsigned int>& b0_index,
+                       unsigned int ref_index,
                        const std::vector<tipl::affine_transform<double> >& arg)
 {
     tipl::geometry<3> geo(dwi_files[0]->image.geometry());
-    unsigned int b1 = 0,b2 = 1;
-    for(unsigned int i = 0;i < dwi_files.size();++i)
+    // each volume is resampled by one thread to keep its source and target in cache
+    tipl::par_for(dwi_files.size(),[&](unsigned int i)
     {
-        if(i == b0_index.front())// the first b0 is the reference
-            continue;
-        if(i == b0_index[b2])
-        {
-            b1 = std::min<unsigned int>(b1+1,b0_index.size()-1);
-            b2 = std::min<unsigned int>(b2+1,b0_index.size()-1);
-        }
-        double dis = b0_index[b2]-b0_index[b1];
-        double w1 = b0_index[b2]-i;
-        double w2 = i - b0_index[b1];
-        if(dis == 0.0)
-        {
-            w1 = 1.0;
-            w2 = 0.0;
-        }
-        else
-        {
-            w1 /= dis;
-            w2 /= dis;
-        }
-        tipl::affine_transform<double> interpolated_arg;
-        for(unsigned int j = 0;j < 6;++j)
-            interpolated_arg.translocation[j] =
-                    arg[b1].translocation[j]*w1 +
-                    arg[b2].translocation[j]*w2;
+        if(i == ref_index)
+            return;
         tipl::vector<3> vs(1,1,1);
         tipl::transformation_matrix<double> T =
-                tipl::transformation_matrix<double>(interpolated_arg,geo,vs,geo,vs);
+                tipl::transformation_matrix<double>(arg[i],geo,vs,geo,vs);
 
         tipl::image<unsigned short,3> new_image(geo);
         tipl::resample(dwi_files[i]->image,new_image,T,tipl::linear);
@@ -89,7 +82,7 @@ void motion_correction(std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
         tipl::vector_rotation(dwi_files[i]->bvec.begin(),tmp.begin(),iT,tipl::vdim<3>());
         tmp.normalize();
         dwi_files[i]->bvec = tmp;
-    }
+    });
 }
 
 
@@ -99,9 +92,10 @@ motion_dialog::motion_dialog(QWidget *parent,std::vector<std::shared_ptr<DwiHead
 {
     ui->setupUi(this);
 
-    motion_detection(threads,dwi_files,b0_index,arg,terminated,finished);
+    start_time = std::chrono::high_resolution_clock::now();
+    motion_detection(threads,dwi_files,ref_index,arg,reg_time,terminated,finished,std::thread::hardware_concurrency());
 
-    ui->progressBar->setMaximum(arg.size());// there is only arg.size()-1 calculating thread
+    ui->progressBar->setMaximum(arg.size());
     ui->progressBar->setValue(0);
     timer.reset(new QTimer(this));
     timer->setInterval(1000);
@@ -213,10 +207,14 @@ void motion_dialog::show_progress(void)
                            arg(tipl::mean(r.begin(),r.end())));
     }
 
-    if(finished == arg.size()-1)
+    if(finished == arg.size() && timer->isActive())
     {
-        finished = arg.size();
         timer->stop();
+        double wall_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-start_time).count();
+        ui->label->setText(ui->label->text() +
+                           QString(" registration:%1 s per volume, %2 s in total").
+                           arg(std::accumulate(reg_time.begin(),reg_time.end(),0.0)/double(std::max<size_t>(1,reg_time.size()-1))).
+                           arg(wall_time));
         ui->correction->setVisible(true);
         ui->progressBar->setVisible(false);
         ui->progress_label->setVisible(false);
@@ -227,7 +225,7 @@ void motion_dialog::on_correction_clicked()
 {
     begin_prog("correcting");
     check_prog(0,2);
-    motion_correction(dwi_files,b0_index,arg);
+    motion_correction(dwi_files,ref_index,arg);
     check_prog(1,2);
     dicom_gui.update_b_table();
     check_prog(2,2);
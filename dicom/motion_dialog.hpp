@@ -1,6 +1,8 @@
 #ifndef MOTION_DIALOG_HPP
 #define MOTION_DIALOG_HPP
 #include <QDialog>
+#include <atomic>
+#include <chrono>
 #include "dwi_header.hpp"
 #include "tipl/tipl.hpp"
 
@@ -14,10 +16,12 @@ class motion_dialog : public QDialog
 private:
     dicom_parser& dicom_gui;
     std::vector<std::shared_ptr<DwiHeader> >& dwi_files;
-    std::vector<unsigned int> b0_index;
+    unsigned int ref_index;
     std::vector<tipl::affine_transform<double> > arg;
+    std::vector<double> reg_time;
     bool terminated;
-    unsigned int finished;
+    std::atomic<unsigned int> finished;
+    std::chrono::high_resolution_clock::time_point start_time;
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::auto_ptr<QTimer> timer;
 public:
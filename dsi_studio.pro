@@ -20,6 +20,7 @@ win32* {
 INCLUDEPATH += ../include
 QMAKE_CXXFLAGS += -wd4244 -wd4267 -wd4018
 RC_FILE = dsi_studio.rc
+LIBS += -lpsapi
 }
 
 linux* {
@@ -106,7 +107,8 @@ HEADERS += mainwindow.h \
     connectometry/match_db.h \
     connectometry/db_window.h \
     connectometry/group_connectometry.hpp \
-    regtoolbox.h
+    regtoolbox.h \
+    cmd/job_output.hpp
 
 FORMS += mainwindow.ui \
     tracking/tracking_window.ui \
@@ -185,6 +187,8 @@ SOURCES += main.cpp \
     regtoolbox.cpp \
     cmd/cnn.cpp \
     cmd/qc.cpp \
+    cmd/bench.cpp \
+    cmd/server.cpp \
     libs/dsi/basic_voxel.cpp \
     libs/dsi/image_model.cpp
 
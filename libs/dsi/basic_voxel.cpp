@@ -129,14 +129,21 @@ void Voxel::run(void)
             ++total_voxel;
 
     unsigned int total = 0;
+    prog_context* prog = current_prog();
     tipl::par_for_asyn2(mask.size(),
                     [&](int voxel_index,int thread_id)
     {
         ++total;
         if(terminated || !mask[voxel_index])
             return;
+        if(prog && prog->aborted())
+        {
+            terminated = true;
+            return;
+        }
         if(thread_id == 0)
         {
+            prog_scope scope(prog);
             if(prog_aborted())
             {
                 terminated = true;
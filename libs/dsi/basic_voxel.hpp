@@ -79,6 +79,7 @@ public:
 public:// DTI
     bool output_diffusivity = false;
     bool output_tensor = false;
+    bool dti_wls = false;// weighted least squares fitting
 public://used in GQI
     bool r2_weighted = false;// used in GQI only
     bool half_sphere = false;
@@ -99,6 +100,7 @@ public:// used in QSDR
     float trans_to_mni[16];
     std::string external_template;
     unsigned char reg_method = 0;
+    bool norm_pyramid = false;// two-level bfnorm, not set by any option until validated against the single-level R
     tipl::transformation_matrix<double> qsdr_trans;
     bool output_jacobian = false;
     bool output_mapping = false;
@@ -254,6 +254,8 @@ const char* ImageModel::reconstruction(void)
             break;
         case 1://DTI
             voxel.recon_report << " The diffusion tensor was calculated.";
+            if(voxel.dti_wls)
+                voxel.recon_report << " The tensor was refitted using weighted least squares.";
             out << ".dti.fib.gz";
             voxel.max_fiber_number = 1;
             if (!reconstruct<dti_process>())
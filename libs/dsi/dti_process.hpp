@@ -1,12 +1,106 @@
 #ifndef DTI_PROCESS_HPP
 #define DTI_PROCESS_HPP
 #include <cmath>
+#include <random>
 #include "basic_voxel.hpp"
 #include "tipl/tipl.hpp"
 
+// an eigenvector of the symmetric 3x3 matrix A for eigenvalue l, from the largest cross product of the rows of A-lI
+inline bool eigen_vector_sym3(const double* A,double l,double* v)
+{
+    double r[3][3] = {{A[0]-l,A[1],A[2]},{A[3],A[4]-l,A[5]},{A[6],A[7],A[8]-l}};
+    double max_norm = 0.0;
+    for(unsigned int i = 0;i < 3;++i)
+    {
+        const double* a = r[i == 2 ? 1 : 0];
+        const double* b = r[i == 0 ? 1 : 2];
+        double c[3] = {a[1]*b[2]-a[2]*b[1],a[2]*b[0]-a[0]*b[2],a[0]*b[1]-a[1]*b[0]};
+        double norm = c[0]*c[0]+c[1]*c[1]+c[2]*c[2];
+        if(norm > max_norm)
+        {
+            max_norm = norm;
+            std::copy(c,c+3,v);
+        }
+    }
+    double scale = 0.0;
+    for(unsigned int i = 0;i < 9;++i)
+        scale = std::max(scale,std::fabs(A[i]));
+    scale *= scale;
+    if(max_norm <= 1.0e-20*scale*scale)
+        return false;
+    max_norm = std::sqrt(max_norm);
+    for(unsigned int i = 0;i < 3;++i)
+        v[i] /= max_norm;
+    return true;
+}
+
+// closed-form eigen decomposition of a symmetric 3x3 matrix (Smith, Commun. ACM 1961).
+// As in tipl::mat::eigen_decomposition_sym, d is in descending order and the rows of V are the eigenvectors.
+inline void eigen_decomposition_sym3(const double* A,double* V,double* d)
+{
+    double q = (A[0]+A[4]+A[8])/3.0;
+    double b00 = A[0]-q,b11 = A[4]-q,b22 = A[8]-q;
+    double p1 = A[1]*A[1]+A[2]*A[2]+A[5]*A[5];
+    double p2 = b00*b00+b11*b11+b22*b22+2.0*p1;
+    std::fill(V,V+9,0.0);
+    if(p2 <= 1.0e-30*q*q || p2 == 0.0) // isotropic
+    {
+        d[0] = d[1] = d[2] = q;
+        V[0] = V[4] = V[8] = 1.0;
+        return;
+    }
+    double p = std::sqrt(p2/6.0);
+    double det = b00*(b11*b22-A[5]*A[5])-A[1]*(A[1]*b22-A[5]*A[2])+A[2]*(A[1]*A[5]-b11*A[2]);
+    double r = std::max(-1.0,std::min(1.0,det/(2.0*p*p*p)));
+    double phi = std::acos(r)/3.0;
+    d[0] = q+2.0*p*std::cos(phi);
+    d[2] = q+2.0*p*std::cos(phi+2.0*M_PI/3.0);
+    d[1] = 3.0*q-d[0]-d[2];
+    // the eigenvector of the more separated eigenvalue is solved first
+    unsigned int first = (d[0]-d[1] > d[1]-d[2]) ? 0 : 2,second = 2-first;
+    double* v1 = V+first*3;
+    double* v2 = V+second*3;
+    if(!eigen_vector_sym3(A,d[first],v1))
+    {
+        V[0] = V[4] = V[8] = 1.0;
+        return;
+    }
+    bool has_v2 = eigen_vector_sym3(A,d[second],v2);
+    if(has_v2)
+    {
+        double dot = v1[0]*v2[0]+v1[1]*v2[1]+v1[2]*v2[2];
+        for(unsigned int i = 0;i < 3;++i)
+            v2[i] -= dot*v1[i];
+        double norm = std::sqrt(v2[0]*v2[0]+v2[1]*v2[1]+v2[2]*v2[2]);
+        has_v2 = norm > 1.0e-6;
+        for(unsigned int i = 0;has_v2 && i < 3;++i)
+            v2[i] /= norm;
+    }
+    if(!has_v2) // degenerate: any direction perpendicular to v1
+    {
+        unsigned int axis = (std::fabs(v1[0]) < std::fabs(v1[1])) ?
+                    (std::fabs(v1[0]) < std::fabs(v1[2]) ? 0 : 2) : (std::fabs(v1[1]) < std::fabs(v1[2]) ? 1 : 2);
+        double e[3] = {0.0,0.0,0.0};
+        e[axis] = 1.0;
+        v2[0] = v1[1]*e[2]-v1[2]*e[1];
+        v2[1] = v1[2]*e[0]-v1[0]*e[2];
+        v2[2] = v1[0]*e[1]-v1[1]*e[0];
+        double norm = std::sqrt(v2[0]*v2[0]+v2[1]*v2[1]+v2[2]*v2[2]);
+        for(unsigned int i = 0;i < 3;++i)
+            v2[i] /= norm;
+    }
+    // the middle eigenvector completes the orthonormal basis
+    V[3] = V[7]*V[2]-V[8]*V[1];
+    V[4] = V[8]*V[0]-V[6]*V[2];
+    V[5] = V[6]*V[1]-V[7]*V[0];
+}
+
 class Dwi2Tensor : public BaseProcess
 {
+public:// output maps
     std::vector<float> d0,d1,d2,d3,md,txx,txy,txz,tyy,tyz,tzz,ha;
+    bool use_fast_eigen = false;
+private:
     float get_fa(float l1,float l2,float l3)
     {
         float ll = (l1+l2+l3)/3.0;
@@ -24,6 +118,48 @@ private:
     std::vector<std::vector<unsigned int> > iKtK_pivot;
     std::vector<double> Kt;
     unsigned int b_count;
+private:
+    void get_eigen(double* tensor,double* V,double* d) const
+    {
+        if(use_fast_eigen)
+            eigen_decomposition_sym3(tensor,V,d);
+        else
+            tipl::mat::eigen_decomposition_sym(tensor,V,d,tipl::dim<3,3>());
+    }
+    // checks the closed-form solver against eigen_decomposition_sym on random tensors
+    // and uses it only if FA, MD, AD, and RD agree to 1e-5
+    void check_fast_eigen(void)
+    {
+        std::mt19937 gen(0);
+        std::uniform_real_distribution<double> ev(0.0,0.003),angle(-M_PI,M_PI);
+        double max_error = 0.0;
+        for(unsigned int i = 0;i < 10000;++i)
+        {
+            double l[3] = {ev(gen),ev(gen),ev(gen)};
+            if(i % 4 == 1) // prolate
+                l[2] = l[1];
+            if(i % 4 == 2) // near isotropic
+                l[1] = l[2] = l[0]*(1.0+1.0e-4*(l[1]-0.0015));
+            double a = angle(gen),b = angle(gen),c = angle(gen);
+            double R[9] = {std::cos(a)*std::cos(b),std::cos(a)*std::sin(b)*std::sin(c)-std::sin(a)*std::cos(c),std::cos(a)*std::sin(b)*std::cos(c)+std::sin(a)*std::sin(c),
+                           std::sin(a)*std::cos(b),std::sin(a)*std::sin(b)*std::sin(c)+std::cos(a)*std::cos(c),std::sin(a)*std::sin(b)*std::cos(c)-std::cos(a)*std::sin(c),
+                           -std::sin(b),std::cos(b)*std::sin(c),std::cos(b)*std::cos(c)};
+            double tensor[9],V[9],d[3],fast_V[9],fast_d[3];
+            for(unsigned int row = 0;row < 3;++row)
+                for(unsigned int col = 0;col < 3;++col)
+                    tensor[row*3+col] = R[row*3]*l[0]*R[col*3]+R[row*3+1]*l[1]*R[col*3+1]+R[row*3+2]*l[2]*R[col*3+2];
+            eigen_decomposition_sym3(tensor,fast_V,fast_d);
+            tipl::mat::eigen_decomposition_sym(tensor,V,d,tipl::dim<3,3>());
+            max_error = std::max<double>(max_error,std::fabs(get_fa(d[0],d[1],d[2])-get_fa(fast_d[0],fast_d[1],fast_d[2])));
+            max_error = std::max<double>(max_error,1000.0*std::fabs(d[0]+d[1]+d[2]-fast_d[0]-fast_d[1]-fast_d[2])/3.0);
+            max_error = std::max<double>(max_error,1000.0*std::fabs(d[0]-fast_d[0]));
+            max_error = std::max<double>(max_error,1000.0*std::fabs(d[1]+d[2]-fast_d[1]-fast_d[2])/2.0);
+            // the main direction is compared only when it is well defined
+            if(d[0]-d[1] > 0.1*d[0])
+                max_error = std::max<double>(max_error,1.0-std::fabs(V[0]*fast_V[0]+V[1]*fast_V[1]+V[2]*fast_V[2]));
+        }
+        use_fast_eigen = max_error < 1.0e-5;
+    }
 public:
     virtual void init(Voxel& voxel)
     {
@@ -106,13 +242,16 @@ public:
             }
             tipl::mat::lu_decomposition(iKtK[i].begin(),iKtK_pivot[i].begin(),tipl::dyndim(6,6));
         }
+        check_fast_eigen();
     }
 public:
     virtual void run(Voxel& voxel, VoxelData& data)
     {
         if(!voxel.output_diffusivity && voxel.method_id != 1)
             return;
-        std::vector<float> signal(data.space.size());
+        thread_local std::vector<float> signal;
+        signal.resize(data.space.size());
+        std::fill(signal.begin(),signal.end(),0.0f);
         if (data.space.front() != 0.0)
         {
             float logs0 = std::log(std::max<float>(1.0,data.space.front()));
@@ -123,20 +262,67 @@ public:
         double KtS[6],tensor_param[6];
         double tensor[9];
         double V[9],d[3];
+        unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
+        unsigned int level = 0;
+        tipl::mat::product(Kt.begin(),signal.begin(),KtS,tipl::dyndim(6,b_count),tipl::dyndim(b_count,1));
         for(unsigned int i = 0;i < iKtK.size();++i)
         {
-            tipl::mat::product(Kt.begin(),signal.begin(),KtS,tipl::dyndim(6,b_count),tipl::dyndim(b_count,1));
+            level = i;
             tipl::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,tipl::dyndim(6,6));
 
-
-            unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
             for (unsigned int index = 0; index < 9; ++index)
                 tensor[index] = tensor_param[tensor_index[index]];
 
-            tipl::mat::eigen_decomposition_sym(tensor,V,d,tipl::dim<3,3>());
+            get_eigen(tensor,V,d);
             if(d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0)
                 break;
         }
+        // weighted least squares: refit with the squared signals predicted by the fit above
+        if(voxel.dti_wls)
+        {
+            double KtWK[36],KtWS[6],wls_param[6];
+            unsigned int pivot[6];
+            std::fill(KtWK,KtWK+36,0.0);
+            std::fill(KtWS,KtWS+6,0.0);
+            for(unsigned int j = 0;j < b_count;++j)
+            {
+                double predicted = 0.0;
+                for(unsigned int k = 0;k < 6;++k)
+                    predicted += Kt[k*b_count+j]*tensor_param[k];
+                double w = std::exp(-2.0*std::max<double>(predicted,0.0));
+                for(unsigned int k = 0;k < 6;++k)
+                {
+                    double wk = w*Kt[k*b_count+j];
+                    KtWS[k] += wk*signal[j];
+                    for(unsigned int m = k;m < 6;++m)
+                        KtWK[k*6+m] += wk*Kt[m*b_count+j];
+                }
+            }
+            for(unsigned int k = 0;k < 6;++k)
+                for(unsigned int m = 0;m < k;++m)
+                    KtWK[k*6+m] = KtWK[m*6+k];
+            if(level) // the same regularization as the unweighted fit
+            {
+                double w = 0.005*std::pow(2.0,(double)level)*(*std::max_element(KtWK,KtWK+36));
+                for(unsigned int j = 0;j < 36;j += 7)
+                    KtWK[j] += w;
+            }
+            double wls_tensor[9],wls_V[9],wls_d[3];
+            tipl::mat::lu_decomposition(KtWK,pivot,tipl::dyndim(6,6));
+            tipl::mat::lu_solve(KtWK,pivot,KtWS,wls_param,tipl::dyndim(6,6));
+            for (unsigned int index = 0; index < 9; ++index)
+                wls_tensor[index] = wls_param[tensor_index[index]];
+            get_eigen(wls_tensor,wls_V,wls_d);
+            bool wls_positive = wls_d[0] > 0.0 && wls_d[1] > 0.0 && wls_d[2] > 0.0;
+            bool ols_positive = d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0;
+            // keeps the unweighted fit if weighting makes the tensor non-positive
+            if(wls_positive || !ols_positive)
+            {
+                std::copy(wls_tensor,wls_tensor+9,tensor);
+                std::copy(wls_V,wls_V+9,V);
+                std::copy(wls_d,wls_d+3,d);
+            }
+        }
         if (d[1] < 0.0)
         {
             d[1] = 0.0;
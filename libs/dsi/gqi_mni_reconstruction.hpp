@@ -30,6 +30,100 @@ protected:
 protected:
     typedef tipl::const_pointer_image<unsigned short,3> point_image_type;
     std::vector<point_image_type> ptr_images;
+protected:
+    static void downsample_half(const tipl::image<float,3>& I,tipl::image<float,3>& J)
+    {
+        J.resize(tipl::geometry<3>((I.width()+1)/2,(I.height()+1)/2,(I.depth()+1)/2));
+        J.for_each_mt([&](float& v,const tipl::pixel_index<3>& index)
+        {
+            float sum = 0.0f;
+            unsigned int count = 0;
+            for(int dz = 0;dz < 2;++dz)
+                for(int dy = 0;dy < 2;++dy)
+                    for(int dx = 0;dx < 2;++dx)
+                    {
+                        int x = index[0]*2+dx,y = index[1]*2+dy,z = index[2]*2+dz;
+                        if(I.geometry().is_valid(x,y,z))
+                        {
+                            sum += I.at(x,y,z);
+                            ++count;
+                        }
+                    }
+            v = count ? sum/float(count) : 0.0f;
+        });
+    }
+    // coarse-to-fine bfnorm. The coarse level solves the large deformation on 1/8 of the voxels,
+    // and the full resolution level only refines the residual, so it needs fewer iterations.
+    // The combined mapping is stored as a displacement field in cdm_dis.
+    void bfnorm_pyramid(const tipl::image<float,3>& VG,const tipl::image<float,3>& VFF,int factor,Voxel& voxel)
+    {
+        tipl::geometry<3> bases(factor*7,factor*9,factor*7);
+        auto t0 = std::chrono::high_resolution_clock::now();
+        auto log_level = [&](const char* level,unsigned int iterations,float r)
+        {
+            auto t1 = std::chrono::high_resolution_clock::now();
+            std::cout << "normalization " << level << ": iterations=" << iterations << " R=" << r
+                      << " time=" << std::chrono::duration<double>(t1-t0).count() << "s" << std::endl;
+            t0 = t1;
+        };
+        // coarse level
+        tipl::image<tipl::vector<3>,3> coarse_dis;
+        {
+            tipl::image<float,3> VGc,VFFc;
+            downsample_half(VG,VGc);
+            downsample_half(VFF,VFFc);
+            tipl::reg::bfnorm_mapping<double,3> coarse_mni(VGc.geometry(),bases);
+            terminated_class ter(64);
+            tipl::reg::bfnorm(coarse_mni,VGc,VFFc,ter,voxel.thread_count);
+            if(prog_aborted())
+                throw std::runtime_error("Reconstruction canceled");
+            coarse_dis.resize(VGc.geometry());
+            coarse_dis.for_each_mt([&](tipl::vector<3>& d,const tipl::pixel_index<3>& index)
+            {
+                tipl::vector<3,int> ipos(index[0],index[1],index[2]);
+                tipl::vector<3,double> Jpos;
+                coarse_mni(ipos,Jpos);
+                d = tipl::vector<3>(Jpos);
+                d -= tipl::vector<3>(index);
+            });
+            log_level("level 1/2",ter.now,-tipl::reg::correlation()(VGc,VFFc,coarse_mni));
+        }
+        // upsample the coarse displacement and warp the subject with it
+        cdm_dis.resize(VG.geometry());
+        cdm_dis.for_each_mt([&](tipl::vector<3>& d,const tipl::pixel_index<3>& index)
+        {
+            tipl::vector<3> p((index[0]-0.5f)*0.5f,(index[1]-0.5f)*0.5f,(index[2]-0.5f)*0.5f);
+            tipl::estimate(coarse_dis,p,d,tipl::linear);
+            d *= 2.0f;
+        });
+        tipl::image<float,3> VFF1;
+        tipl::compose_displacement(VFF,cdm_dis,VFF1);
+        // full resolution level
+        mni.reset(new tipl::reg::bfnorm_mapping<double,3>(VG.geometry(),bases));
+        {
+            terminated_class ter(16);
+            tipl::reg::bfnorm(*mni.get(),VG,VFF1,ter,voxel.thread_count);
+            if(prog_aborted())
+                throw std::runtime_error("Reconstruction canceled");
+            voxel.R2 = -tipl::reg::correlation()(VG,VFF1,(*mni.get()));
+            log_level("level 2/2",ter.now,voxel.R2);
+        }
+        // combine both levels: x -> m(x) -> m(x) + coarse displacement at m(x)
+        tipl::image<tipl::vector<3>,3> dis(VG.geometry());
+        dis.for_each_mt([&](tipl::vector<3>& d,const tipl::pixel_index<3>& index)
+        {
+            tipl::vector<3,int> ipos(index[0],index[1],index[2]);
+            tipl::vector<3,double> Jpos;
+            (*mni.get())(ipos,Jpos);
+            tipl::vector<3> m(Jpos),d1;
+            tipl::estimate(cdm_dis,m,d1,tipl::linear);
+            d = m;
+            d += d1;
+            d -= tipl::vector<3>(index);
+        });
+        cdm_dis.swap(dis);
+        mni.reset();
+    }
 
 public:
     virtual void init(Voxel& voxel)
@@ -216,7 +310,7 @@ public:
                     tipl::reg::affine,tipl::reg::correlation(),terminated,voxel.thread_count);
             }
             VFF.resize(VG.geometry());
-            tipl::resample(VF,VFF,affine,tipl::cubic);
+            tipl::resample_mt(VF,VFF,affine,tipl::cubic);
             if(prog_aborted())
                 throw std::runtime_error("Reconstruction canceled");
 
@@ -236,11 +330,19 @@ public:
             int factor = voxel.reg_method + 1;
 
             {
+                // the pyramid is not exposed as an option until its R and time are compared with the single level.
+                // It needs at least 32 voxels per dimension at the coarse level
+                if(voxel.norm_pyramid && factor <= 3 && VG.width() >= 64 && VG.height() >= 64 && VG.depth() >= 64)
+                    bfnorm_pyramid(VG,VFF,factor,voxel);
+                else
                 if(factor <= 3)
                 {
+                    auto t0 = std::chrono::high_resolution_clock::now();
                     mni.reset(new tipl::reg::bfnorm_mapping<double,3>(VG.geometry(),tipl::geometry<3>(factor*7,factor*9,factor*7)));
                     tipl::reg::bfnorm(*mni.get(),VG,VFF,ter,voxel.thread_count);
                     voxel.R2 = -tipl::reg::correlation()(VG,VFF,(*mni.get()));
+                    std::cout << "normalization: iterations=" << ter.now << " R=" << voxel.R2 << " time="
+                              << std::chrono::duration<double>(std::chrono::high_resolution_clock::now()-t0).count() << "s" << std::endl;
                     if(export_intermediate)
                     {
                         tipl::image<float,3> VFFF(VG.geometry());
@@ -263,6 +365,8 @@ public:
         }
         catch(...)
         {
+            if(prog_aborted())
+                throw std::runtime_error("Reconstruction canceled");
             throw std::runtime_error("Registration failed due to memory insufficiency. Please try norm 7-9-7 or 14-18-14.");
         }
 
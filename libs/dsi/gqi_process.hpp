@@ -8,17 +8,46 @@
 #include "image_model.hpp"
 
 double base_function(double theta);
+
+// sin(x)/x with a branch-free polynomial so that the loop over DWIs vectorizes.
+// x is reduced to [-pi/2,pi/2] and the Taylor series up to x^11 has an error below 1e-7
+inline float fast_sinc(float x)
+{
+    const float pi = 3.14159265358979f;
+    float k = std::floor(x*(1.0f/pi)+0.5f);
+    float r = x-k*pi;
+    float r2 = r*r;
+    float s = r*(1.0f+r2*(-1.0f/6.0f+r2*(1.0f/120.0f+r2*(-1.0f/5040.0f+r2*(1.0f/362880.0f+r2*(-1.0f/39916800.0f))))));
+    if(int(k) & 1)
+        s = -s;
+    return std::fabs(x) < 1.0e-4f ? 1.0f-x*x*(1.0f/6.0f) : s/x;
+}
+
 class GQI_Recon  : public BaseProcess
 {
 public:// recorded for scheme balanced
     std::vector<tipl::vector<3,float> > q_vectors_time;
+    bool use_fast_sinc = false;
 public:
     std::vector<float> sinc_ql;
 public:
     virtual void init(Voxel& voxel)
     {
         if(!voxel.grad_dev.empty() || voxel.qsdr)
+        {
             voxel.calculate_q_vec_t(q_vectors_time);
+            // check the approximation against the exact sinc over the range of q*dir
+            float max_q = 0.0f;
+            for(unsigned int i = 0;i < q_vectors_time.size();++i)
+                max_q = std::max<float>(max_q,q_vectors_time[i].length());
+            float max_error = 0.0f;
+            for(unsigned int i = 0;i <= 10000;++i)
+            {
+                float x = max_q*float(i)/10000.0f;
+                max_error = std::max<float>(max_error,std::fabs(fast_sinc(x)-float(boost::math::sinc_pi(x))));
+            }
+            use_fast_sinc = max_error < 1.0e-5f;
+        }
         else
             voxel.calculate_sinc_ql(sinc_ql);
     }
@@ -37,12 +66,24 @@ public:
                     data.jacobian[i] = voxel.grad_dev[i][data.voxel_index];
                 tipl::mat::transpose(data.jacobian.begin(),tipl::dim<3,3>());
             }
-            std::vector<float> sinc_ql_(data.odf.size()*data.space.size());
+            // reused across voxels processed by the same thread
+            thread_local std::vector<float> sinc_ql_;
+            sinc_ql_.resize(data.odf.size()*data.space.size());
             for (unsigned int j = 0,index = 0; j < data.odf.size(); ++j)
             {
                 tipl::vector<3,float> from(voxel.ti.vertices[j]);
                 from.rotate(data.jacobian);
                 from.normalize();
+                if(use_fast_sinc && !voxel.r2_weighted)
+                {
+                    float* out = &sinc_ql_[index];
+                    for (unsigned int i = 0; i < data.space.size(); ++i)
+                        out[i] = q_vectors_time[i]*from;
+                    for (unsigned int i = 0; i < data.space.size(); ++i)
+                        out[i] = fast_sinc(out[i]);
+                    index += data.space.size();
+                }
+                else
                 if(voxel.r2_weighted)
                     for (unsigned int i = 0; i < data.space.size(); ++i,++index)
                         sinc_ql_[index] = base_function(q_vectors_time[i]*from);
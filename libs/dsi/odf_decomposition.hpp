@@ -10,6 +10,12 @@
 
 struct ODFDecomposition : public BaseProcess
 {
+    // buffers reused across the voxels processed by the same thread
+    struct workspace{
+        std::vector<float> old_odf,w,residual,tmp,RRt,results;
+        std::vector<char> fib_map;
+        std::vector<int> dir_list,neighbors;
+    };
     std::vector<std::vector<unsigned char> > is_neighbor;
     float decomposition_fraction;
 protected:
@@ -34,17 +40,15 @@ protected:
                              double cur_angle,double sigma)
     {
         sigma *= sigma;
-        std::vector<double> weighting(inner_angles.size());
+        double result = 0.0,sum_weighting = 0.0;
         for (unsigned int index = 0; index < inner_angles.size(); ++index)
         {
             double dx = cur_angle-inner_angles[index];
-            weighting[index] = std::exp(-dx*dx/2.0/sigma);
+            double weighting = std::exp(-dx*dx/2.0/sigma);
+            result += fiber_profile[index]*weighting;
+            sum_weighting += weighting;
         }
-        double result = 0.0;
-        for (unsigned int index = 0; index < fiber_profile.size(); ++index)
-            result += fiber_profile[index]*weighting[index];
-        result /= std::accumulate(weighting.begin(),weighting.end(),0.0);
-        return result;
+        return result/sum_weighting;
     }
 
     template<class iterator_type>
@@ -67,11 +71,13 @@ protected:
 
 
         Rt.resize(half_odf_size*half_odf_size);
-        for (unsigned int i = 0,index = 0; i < half_odf_size; ++i)
+        // symmetric, as in ODFDeconvolusion::estimate_Rt
+        tipl::par_for(half_odf_size,[&](unsigned int i)
         {
-            for (unsigned int j = 0; j < half_odf_size; ++j,++index)
-                Rt[index] = kernel_regression(voxel.response_function,inner_angles,inner_angle(voxel.ti.vertices_cos(i,j)),9.0/180.0*M_PI);
-        }
+            for (unsigned int j = i; j < half_odf_size; ++j)
+                Rt[i*half_odf_size+j] = Rt[j*half_odf_size+i] =
+                    kernel_regression(voxel.response_function,inner_angles,inner_angle(voxel.ti.vertices_cos(i,j)),9.0/180.0*M_PI);
+        });
         oRt = Rt;
         for (unsigned int i = 0; i < half_odf_size; ++i)
         {
@@ -101,13 +107,16 @@ protected:
         return t1/t2;
     }
 
-    void lasso2(const std::vector<float>& y,const std::vector<float>& x,std::vector<float>& w,unsigned int max_fiber)
+    void lasso2(const std::vector<float>& y,const std::vector<float>& x,std::vector<float>& w,unsigned int max_fiber,workspace& ws)
     {
         unsigned int y_dim = y.size();
-        std::vector<float> residual(y);
-        std::vector<float> tmp(y_dim);
-        std::vector<char> fib_map(y_dim);
-        w.resize(y_dim);
+        std::vector<float>& residual = ws.residual;
+        std::vector<float>& tmp = ws.tmp;
+        std::vector<char>& fib_map = ws.fib_map;
+        residual.assign(y.begin(),y.end());
+        tmp.resize(y_dim);
+        fib_map.assign(y_dim,0);
+        w.assign(y_dim,0.0f);
 
         float step_size = decomposition_fraction;
         unsigned int max_iter = ((float)max_fiber/step_size);
@@ -200,18 +209,23 @@ public:
 
         if (!voxel.odf_decomposition)
             return;
-        std::vector<float> old_odf(data.odf);
+        thread_local workspace ws;
+        std::vector<float>& old_odf = ws.old_odf;
+        std::vector<float>& w = ws.w;
+        std::vector<int>& dir_list = ws.dir_list;
+        std::vector<float>& results = ws.results;
+        std::vector<float>& RRt = ws.RRt;
+        std::vector<int>& neighbors = ws.neighbors;
+        old_odf.assign(data.odf.begin(),data.odf.end());
         normalize_vector(data.odf.begin(),data.odf.end());
-        std::vector<float> w;
-        lasso2(data.odf,Rt,w,m);
-
-        std::vector<int> dir_list;
+        lasso2(data.odf,Rt,w,m,ws);
 
+        dir_list.clear();
         for(unsigned int index = 0;index < half_odf_size;++index)
             if(w[index] > 0.0)
                 dir_list.push_back(index);
 
-        std::vector<float> results;
+        results.clear();
         int has_isotropic = 1;
         while(1)
         {
@@ -222,18 +236,13 @@ public:
                 has_isotropic = 1;
                 break;
             }
-            std::vector<float> RRt;
+            RRt.clear();
             if(has_isotropic)
-            {
-                RRt.resize(half_odf_size);
-                std::fill(RRt.begin(),RRt.end(),1.0);
-            }
+                RRt.resize(half_odf_size,1.0f);
             for (unsigned int index = 0;index < dir_list.size();++index)
             {
                 int dir = dir_list[index];
-                std::copy(oRt.begin()+dir*half_odf_size,
-                          oRt.begin()+(1+dir)*half_odf_size,
-                          std::back_inserter(RRt));
+                RRt.insert(RRt.end(),oRt.begin()+dir*half_odf_size,oRt.begin()+(1+dir)*half_odf_size);
             }
             results.resize(dir_list.size()+has_isotropic);
 
@@ -254,7 +263,7 @@ public:
             }
 
             // drop non local maximum
-            std::vector<int> neighbors;
+            neighbors.clear();
             for(unsigned int i = 0;i < dir_list.size();++i)
                 for(unsigned int j = i+1;j < dir_list.size();++j)
                     if(is_neighbor[dir_list[i]][dir_list[j]])
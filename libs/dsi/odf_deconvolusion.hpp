@@ -56,6 +56,8 @@ class ODFDeconvolusion  : public BaseProcess
 protected:
     std::vector<float> A,Rt;
     std::vector<unsigned int> pv;
+    // (Rt*Rt'+lambda*I)^-1*Rt, the projection and the regularized solve in one operator
+    std::vector<float> D;
     float sensitivity_error_percentage;
 	float specificity_error_percentage;
 	// for iterative deconvolution
@@ -74,18 +76,17 @@ protected:
                              const std::vector<double>& inner_angles,
                              double cur_angle,double sigma)
     {
+        // one pass without a weighting buffer, summed in the same order
         sigma *= sigma;
-        std::vector<double> weighting(inner_angles.size());
+        double result = 0.0,sum_weighting = 0.0;
         for (unsigned int index = 0; index < inner_angles.size(); ++index)
         {
             double dx = cur_angle-inner_angles[index];
-            weighting[index] = std::exp(-dx*dx/2.0/sigma);
+            double weighting = std::exp(-dx*dx/2.0/sigma);
+            result += fiber_profile[index]*weighting;
+            sum_weighting += weighting;
         }
-        double result = 0.0;
-        for (unsigned int index = 0; index < fiber_profile.size(); ++index)
-            result += fiber_profile[index]*weighting[index];
-        result /= std::accumulate(weighting.begin(),weighting.end(),0.0);
-        return result;
+        return result/sum_weighting;
     }
     void estimate_Rt(Voxel& voxel)
     {
@@ -98,16 +99,20 @@ protected:
 
 
         Rt.resize(half_odf_size*half_odf_size);
-        for (unsigned int i = 0,index = 0; i < half_odf_size; ++i)
-            for (unsigned int j = 0; j < half_odf_size; ++j,++index)
-                Rt[index] = kernel_regression(voxel.response_function,inner_angles,inner_angle(voxel.ti.vertices_cos(i,j)),9.0/180.0*M_PI);
+        // Rt is symmetric because the kernel only depends on the angle between the two directions
+        tipl::par_for(half_odf_size,[&](unsigned int i)
+        {
+            for (unsigned int j = i; j < half_odf_size; ++j)
+                Rt[i*half_odf_size+j] = Rt[j*half_odf_size+i] =
+                    kernel_regression(voxel.response_function,inner_angles,inner_angle(voxel.ti.vertices_cos(i,j)),9.0/180.0*M_PI);
+        });
     }
 
 	void deconvolution(std::vector<float>& odf)
 	{
 		std::vector<float> tmp(half_odf_size);
-        tipl::mat::vector_product(&*Rt.begin(),&*odf.begin(),&*tmp.begin(),tipl::dyndim(half_odf_size,half_odf_size));
-        tipl::mat::lu_solve(&*A.begin(),&*pv.begin(),&*tmp.begin(),&*odf.begin(),tipl::dyndim(half_odf_size,half_odf_size));
+        tipl::mat::vector_product(&*D.begin(),&*odf.begin(),&*tmp.begin(),tipl::dyndim(half_odf_size,half_odf_size));
+        odf.swap(tmp);
 	}
 	void remove_isotropic(std::vector<float>& odf)
 	{
@@ -174,6 +179,18 @@ public:
             A[index] += voxel.param[2];
         tipl::mat::lu_decomposition(A.begin(),pv.begin(),tipl::dyndim(half_odf_size,half_odf_size));
 
+        // solve A*D = Rt column by column
+        D.resize(half_odf_size*half_odf_size);
+        tipl::par_for(half_odf_size,[&](unsigned int k)
+        {
+            std::vector<float> b(half_odf_size),x(half_odf_size);
+            for (unsigned int i = 0; i < half_odf_size; ++i)
+                b[i] = Rt[i*half_odf_size+k];
+            tipl::mat::lu_solve(&*A.begin(),&*pv.begin(),&*b.begin(),&*x.begin(),tipl::dyndim(half_odf_size,half_odf_size));
+            for (unsigned int i = 0; i < half_odf_size; ++i)
+                D[i*half_odf_size+k] = x[i];
+        });
+
         get_error_percentage(voxel);
 		
     }
@@ -32,7 +32,8 @@ public:
     template<class char_type>
     bool open(const char_type* file_name)
     {
-        prog_aborted_ = false;
+        if(!current_prog())
+            prog_aborted_ = false;
         in.open(file_name,std::ios::binary);
         unsigned int gz_size = 0;
         if(in)
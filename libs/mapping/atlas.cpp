@@ -1,12 +1,20 @@
 #include "atlas.hpp"
 #include <fstream>
 #include <sstream>
+#include <future>
+#include <cstdio>
+#include <limits>
 #include "libs/gzip_interface.hpp"
 #include <QCoreApplication>
 #include <QDir>
+#include <QFile>
+#include <QCryptographicHash>
+#include <QStandardPaths>
 
 std::vector<atlas> atlas_list;
 atlas* track_atlas = 0;
+// declared after atlas_list so that exiting waits for the loading before atlas_list is destroyed
+std::future<void> atlas_loading;
 void load_atlas(void)
 {
     QDir dir = QCoreApplication::applicationDirPath()+ "/atlas";
@@ -24,7 +32,106 @@ void load_atlas(void)
         if(atlas_list[index].name == "tracks")
             track_atlas = &atlas_list[index];
     }
+}
+// decodes the label atlases in the background once they are about to be used, e.g. by the atlas dialog.
+// The track atlas is a large 4-D volume and is still loaded on first use.
+void preload_atlas(void)
+{
+    static std::once_flag started;
+    std::call_once(started,[]()
+    {
+        atlas_loading = std::async(std::launch::async,[]()
+        {
+            tipl::par_for(atlas_list.size(),[&](unsigned int i)
+            {
+                if(&atlas_list[i] == track_atlas)
+                    return;
+                try{
+                    atlas_list[i].load();
+                }
+                catch(...){} // reported again when the atlas is used
+            });
+        });
+    });
+}
+
+// decoded volumes are cached in the user cache folder, keyed by the md5 of the atlas file
+std::string get_atlas_cache_name(const std::string& file_name)
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    QFile file(file_name.c_str());
+    if(dir.isEmpty() || !file.open(QIODevice::ReadOnly))
+        return std::string();
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    if(!hash.addData(&file) || !QDir().mkpath(dir + "/atlas"))
+        return std::string();
+    return (dir + "/atlas/" + QFileInfo(file_name.c_str()).baseName() + "." +
+            QString(hash.result().toHex()) + ".mat").toStdString();
+}
+
+bool atlas::load_from_cache(const std::string& cache_name)
+{
+    gz_mat_read in;
+    if(!QFileInfo(cache_name.c_str()).exists() || !in.load_from_file(cache_name.c_str()))
+        return false;
+    unsigned int row,col;
+    const int* dim = 0;
+    const float* trans = 0;
+    if(!in.read("dimension",row,col,dim) || row*col != 4 ||
+       !in.read("transform",row,col,trans) || row*col != 16)
+        return false;
+    tipl::geometry<4> geo(dim[0],dim[1],dim[2],dim[3]);
+    is_track = (dim[3] > 1);
+    if(is_track)
+    {
+        const unsigned char* track_ptr = 0;
+        if(!in.read("track",row,col,track_ptr) || size_t(row)*col != geo.size())
+            return false;
+        track.resize(geo);
+        std::copy(track_ptr,track_ptr+geo.size(),track.begin());
+        I.resize(tipl::geometry<3>(dim[0],dim[1],dim[2]));
+        for(unsigned int i = 0;i < track.size();i += I.size())
+            track_base_pos.push_back(i);
+    }
+    else
+    {
+        const unsigned short* image_ptr = 0;
+        if(!in.read("image",row,col,image_ptr) || size_t(row)*col != geo.size())
+            return false;
+        I.resize(tipl::geometry<3>(dim[0],dim[1],dim[2]));
+        std::copy(image_ptr,image_ptr+I.size(),I.begin());
+    }
+    std::copy(trans,trans+16,transform.begin());
+    return true;
+}
 
+void atlas::save_to_cache(const std::string& cache_name) const
+{
+    if(I.empty())
+        return;
+    std::vector<unsigned short> image;
+    if(!is_track)
+    {
+        // labels are stored as 16-bit values
+        if(*std::min_element(I.begin(),I.end()) < 0 || *std::max_element(I.begin(),I.end()) > 65535)
+            return;
+        image.assign(I.begin(),I.end());
+    }
+    int dim[4] = {int(I.width()),int(I.height()),int(I.depth()),is_track ? int(track_base_pos.size()) : 1};
+    std::string tmp_file = cache_name + ".tmp";
+    {
+        gz_mat_write out(tmp_file.c_str());
+        if(!out)
+            return;
+        out.write("dimension",dim,1,4);
+        out.write("transform",transform.begin(),4,4);
+        if(is_track)
+            out.write("track",reinterpret_cast<const unsigned char*>(&*track.begin()),1,(unsigned int)track.size());
+        else
+            out.write("image",&image[0],1,(unsigned int)image.size());
+    }
+    std::remove(cache_name.c_str());
+    std::rename(tmp_file.c_str(),cache_name.c_str());
 }
 
 void atlas::load_label(void)
@@ -96,23 +203,28 @@ void atlas::load_label(void)
 
 void atlas::load_from_file(void)
 {
-    gz_nifti nii;
-    if(!nii.load_from_file(filename.c_str()))
-        throw std::runtime_error("Cannot load atlas file");
-    is_track = (nii.dim(4) > 1); // 4d nifti as track files
-    if(is_track)
+    std::string cache_name = get_atlas_cache_name(filename);
+    if(cache_name.empty() || !load_from_cache(cache_name))
     {
-        nii >> track;
-        I.resize(tipl::geometry<3>(track.width(),track.height(),track.depth()));
-        for(unsigned int i = 0;i < track.size();i += I.size())
-            track_base_pos.push_back(i);
+        gz_nifti nii;
+        if(!nii.load_from_file(filename.c_str()))
+            throw std::runtime_error("Cannot load atlas file");
+        is_track = (nii.dim(4) > 1); // 4d nifti as track files
+        track_base_pos.clear();
+        if(is_track)
+        {
+            nii >> track;
+            I.resize(tipl::geometry<3>(track.width(),track.height(),track.depth()));
+            for(unsigned int i = 0;i < track.size();i += I.size())
+                track_base_pos.push_back(i);
+        }
+        else
+            nii >> I;
+        transform.identity();
+        nii.get_image_transformation(transform.begin());
+        if(!cache_name.empty())
+            save_to_cache(cache_name);
     }
-    else
-        nii >> I;
-
-    transform.identity();
-    nii.get_image_transformation(transform.begin());
-    transform.inv();
 
     if(labels.empty())
         load_label();
@@ -165,6 +277,77 @@ void atlas::load_from_file(void)
             }*/
         }
     }
+    build_index();
+    transform.inv();
+}
+
+// label lookup table and bounding boxes of the labels, built once so that
+// queries do not scan the label list or voxels outside a region
+void atlas::build_index(void)
+{
+    unsigned int label_count = is_track ? std::min<unsigned int>(track_base_pos.size(),labels.size()) : labels.size();
+    if(!is_track)
+    {
+        if(!index2label.empty()) // talairach
+            value2label = index2label;
+        else
+        {
+            value2label.clear();
+            for(unsigned int i = 0;i < label_num.size();++i)
+                if(label_num[i] >= 0)
+                {
+                    if(label_num[i] >= int(value2label.size()))
+                        value2label.resize(label_num[i]+1);
+                    value2label[label_num[i]].push_back(i);
+                }
+        }
+    }
+    std::vector<tipl::vector<3,int> > lo(label_count,tipl::vector<3,int>(I.width(),I.height(),I.depth())),
+                                      hi(label_count,tipl::vector<3,int>(-1,-1,-1));
+    auto add_voxel = [&](unsigned int label,const tipl::pixel_index<3>& index)
+    {
+        for(unsigned int d = 0;d < 3;++d)
+        {
+            lo[label][d] = std::min<int>(lo[label][d],index[d]);
+            hi[label][d] = std::max<int>(hi[label][d],index[d]);
+        }
+    };
+    if(is_track)
+        tipl::par_for(label_count,[&](unsigned int label)
+        {
+            for(tipl::pixel_index<3> index(I.geometry());index < I.size();++index)
+                if(track[track_base_pos[label]+index.index()])
+                    add_voxel(label,index);
+        });
+    else
+        for(tipl::pixel_index<3> index(I.geometry());index < I.size();++index)
+        {
+            int value = I[index.index()];
+            if(value >= 0 && value < int(value2label.size()))
+                for(unsigned int i = 0;i < value2label[value].size();++i)
+                    add_voxel(value2label[value][i],index);
+        }
+    // transform is still the voxel-to-template transformation here
+    region_min.clear();
+    region_max.clear();
+    float max_value = std::numeric_limits<float>::max();
+    region_min.resize(label_count,tipl::vector<3>(max_value,max_value,max_value));
+    region_max.resize(label_count,tipl::vector<3>(-max_value,-max_value,-max_value));
+    for(unsigned int label = 0;label < label_count;++label)
+        if(hi[label][0] >= 0)
+            for(unsigned int corner = 0;corner < 8;++corner)
+            {
+                // the corners are half a voxel outside because locations are rounded to voxels
+                tipl::vector<3> pos((corner & 1) ? hi[label][0]+0.5f : lo[label][0]-0.5f,
+                                    (corner & 2) ? hi[label][1]+0.5f : lo[label][1]-0.5f,
+                                    (corner & 4) ? hi[label][2]+0.5f : lo[label][2]-0.5f);
+                pos.to(transform);
+                for(unsigned int d = 0;d < 3;++d)
+                {
+                    region_min[label][d] = std::min(region_min[label][d],pos[d]);
+                    region_max[label][d] = std::max(region_max[label][d],pos[d]);
+                }
+            }
 }
 
 
@@ -213,10 +396,17 @@ int atlas::get_index(tipl::vector<3,float> atlas_space)
 
 bool atlas::is_labeled_as(const tipl::vector<3,float>& mni_space,unsigned int label_name_index)
 {
-    if(I.empty())
-        load_from_file();
+    load();
     if(label_name_index >= label_num.size())
         return false;
+    if(label_name_index < region_min.size())
+    {
+        const tipl::vector<3>& lo = region_min[label_name_index];
+        const tipl::vector<3>& hi = region_max[label_name_index];
+        if(mni_space[0] < lo[0] || mni_space[1] < lo[1] || mni_space[2] < lo[2] ||
+           mni_space[0] > hi[0] || mni_space[1] > hi[1] || mni_space[2] > hi[2])
+            return false;
+    }
 
     int offset = get_index(mni_space);
     if(!offset || offset >= I.size())
@@ -239,10 +429,28 @@ bool atlas::is_labeled_as(const tipl::vector<3,float>& mni_space,unsigned int la
         return false;
     return std::find(index2label[l].begin(),index2label[l].end(),label_name_index) != index2label[l].end();
 }
+// all labels at the location, in the order of get_list()
+void atlas::get_label_index_at(const tipl::vector<3,float>& mni_space,std::vector<unsigned int>& label_index)
+{
+    load();
+    label_index.clear();
+    int offset = get_index(mni_space);
+    if(!offset || offset >= I.size())
+        return;
+    if(is_track)
+    {
+        for(unsigned int j = 0;j < track_base_pos.size() && j < label_num.size();++j)
+            if(track[track_base_pos[j] + offset])
+                label_index.push_back(j);
+        return;
+    }
+    int l = I[offset];
+    if(l >= 0 && l < int(value2label.size()))
+        label_index.assign(value2label[l].begin(),value2label[l].end());
+}
 int atlas::get_track_label(const std::vector<tipl::vector<3> >& points)
 {
-    if(I.empty())
-        load_from_file();
+    load();
     if(!is_track)
         return -1;
     std::vector<int> vote(track_base_pos.size());
@@ -3,18 +3,27 @@
 #include "tipl/tipl.hpp"
 #include <vector>
 #include <string>
+#include <memory>
+#include <mutex>
 class atlas{
 private:
     tipl::image<int,3> I;
     std::vector<int> label_num;
     std::vector<std::string> labels;
     tipl::matrix<4,4,float> transform;
+    std::shared_ptr<std::once_flag> load_flag;
     void load_from_file(void);
+    bool load_from_cache(const std::string& cache_name);
+    void save_to_cache(const std::string& cache_name) const;
     void load_label(void);
+    void build_index(void);
     int get_index(tipl::vector<3,float> atlas_space);
 private:// for talairach only
     std::vector<std::vector<unsigned int> > index2label;
     std::vector<std::vector<unsigned int> > label2index;
+private:// built once at loading
+    std::vector<std::vector<unsigned int> > value2label;// label indices of each voxel value
+    std::vector<tipl::vector<3> > region_min,region_max;// bounding box of each label in the template space
 private:// for track atlas only
     tipl::image<char,4> track;
     std::vector<unsigned int> track_base_pos;
@@ -22,28 +31,27 @@ private:// for track atlas only
 public:
     std::string name,filename;
 public:
+    atlas(void):load_flag(new std::once_flag),is_track(false){}
+    // a copy would share the load flag but not the loaded data, so atlases are only moved
+    atlas(const atlas&) = delete;
+    atlas& operator=(const atlas&) = delete;
+    atlas(atlas&&) = default;
+    atlas& operator=(atlas&&) = default;
+    // loads the image and labels once. It is safe to call from multiple threads.
+    void load(void){std::call_once(*load_flag,[this](){load_from_file();});}
     const std::vector<std::string>& get_list(void)
     {
-        if(labels.empty())
-        {
-            load_label();
-            if(labels.empty())
-                load_from_file();
-        }
+        load();
         return labels;
     }
     const std::vector<int>& get_num(void)
     {
-        if(labels.empty())
-        {
-            load_label();
-            if(labels.empty())
-                load_from_file();
-        }
+        load();
         return label_num;
     }
     //std::string get_label_name_at(const tipl::vector<3,float>& mni_space);
     bool is_labeled_as(const tipl::vector<3,float>& mni_space,unsigned int label);
+    void get_label_index_at(const tipl::vector<3,float>& mni_space,std::vector<unsigned int>& label_index);
     int get_track_label(const std::vector<tipl::vector<3> >& points);
 };
 
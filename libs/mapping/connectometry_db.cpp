@@ -1,3 +1,9 @@
+#include <QFile>
+#include <QFileInfo>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include "connectometry_db.hpp"
 #include "fib_data.hpp"
 
@@ -6,31 +12,49 @@ void connectometry_db::read_db(fib_data* handle_)
     handle = handle_;
     subject_qa.clear();
     subject_qa_sd.clear();
+    subject_matrix = 0;
+    subject_matrix_file.reset();
     unsigned int row,col;
-    for(unsigned int index = 0;1;++index)
+    std::string matrix_file;
     {
-        std::ostringstream out;
-        out << "subject" << index;
-        const float* buf = 0;
-        handle->mat_reader.read(out.str().c_str(),row,col,buf);
-        if (!buf)
-            break;
-        if(!index)
-            subject_qa_length = row*col;
-        subject_qa.push_back(buf);
-        subject_qa_sd.push_back(0);
+        const char* str = 0;
+        if(handle->mat_reader.read("subject_matrix",row,col,str))
+            matrix_file = std::string(str,str+row*col);
+    }
+    if(!matrix_file.empty())
+    {
+        // the subject data are mapped from a separate file after si2vi is calculated
+        const float* sd = 0;
+        if(handle->mat_reader.read("subject_qa_sd",row,col,sd))
+            subject_qa_sd = std::vector<float>(sd,sd+row*col);
     }
+    else
+    {
+        for(unsigned int index = 0;1;++index)
+        {
+            std::ostringstream out;
+            out << "subject" << index;
+            const float* buf = 0;
+            handle->mat_reader.read(out.str().c_str(),row,col,buf);
+            if (!buf)
+                break;
+            if(!index)
+                subject_qa_length = row*col;
+            subject_qa.push_back(buf);
+            subject_qa_sd.push_back(0);
+        }
 
-    tipl::par_for(subject_qa.size(),[&](int i){
-        subject_qa_sd[i] = tipl::standard_deviation(subject_qa[i],subject_qa[i]+subject_qa_length);
-        if(subject_qa_sd[i] == 0.0)
-            subject_qa_sd[i] = 1.0;
-        else
-            subject_qa_sd[i] = 1.0/subject_qa_sd[i];
+        tipl::par_for(subject_qa.size(),[&](int i){
+            subject_qa_sd[i] = tipl::standard_deviation(subject_qa[i],subject_qa[i]+subject_qa_length);
+            if(subject_qa_sd[i] == 0.0)
+                subject_qa_sd[i] = 1.0;
+            else
+                subject_qa_sd[i] = 1.0/subject_qa_sd[i];
 
-    });
+        });
+    }
 
-    num_subjects = (unsigned int)subject_qa.size();
+    num_subjects = (unsigned int)subject_qa_sd.size();
     subject_names.resize(num_subjects);
     R2.resize(num_subjects);
     if(!num_subjects)
@@ -68,12 +92,118 @@ void connectometry_db::read_db(fib_data* handle_)
     }
 
     calculate_si2vi();
+    if(!matrix_file.empty())
+    {
+        // a relative path is relative to the db file
+        if(QFileInfo(matrix_file.c_str()).isRelative())
+            matrix_file = QFileInfo(handle->fib_file_name.c_str()).absolutePath().toStdString() + "/" + matrix_file;
+        if(!map_subject_matrix(matrix_file))
+        {
+            num_subjects = 0;
+            subject_qa_sd.clear();
+            return;
+        }
+    }
+}
+
+bool connectometry_db::map_subject_matrix(const std::string& file_name)
+{
+    size_t size = size_t(num_subjects)*size_t(subject_qa_length)*sizeof(float);
+    std::shared_ptr<QFile> file(new QFile(file_name.c_str()));
+    if(!file->open(QIODevice::ReadOnly))
+    {
+        handle->error_msg = "Cannot open the subject matrix ";
+        handle->error_msg += file_name;
+        return false;
+    }
+    if(size_t(file->size()) != size)
+    {
+        handle->error_msg = "Subject matrix size does not match the db ";
+        handle->error_msg += file_name;
+        return false;
+    }
+    uchar* buf = file->map(0,size);
+    if(!buf)
+    {
+        handle->error_msg = "Cannot map the subject matrix ";
+        handle->error_msg += file_name;
+        return false;
+    }
+    subject_matrix_file = file;
+    subject_matrix = (const float*)buf;
+    return true;
+}
+
+// copies the mapped subject matrix into memory so that the subject list can be edited
+void connectometry_db::load_subject_matrix(void)
+{
+    if(!subject_matrix)
+        return;
+    std::vector<std::vector<float> > data(num_subjects);
+    for(unsigned int i = 0;i < num_subjects;++i)
+        data[i].resize(subject_qa_length);
+    // one pass through the file
+    for(size_t pos = 0;pos < subject_qa_length;++pos)
+    {
+        const float* column = get_subject_column(pos);
+        for(unsigned int i = 0;i < num_subjects;++i)
+            data[i][pos] = column[i];
+    }
+    subject_qa.clear();
+    for(unsigned int i = 0;i < num_subjects;++i)
+    {
+        subject_qa_buf.push_back(std::vector<float>());
+        subject_qa_buf.back().swap(data[i]);
+        subject_qa.push_back(&(subject_qa_buf.back()[0]));
+    }
+    subject_matrix = 0;
+    subject_matrix_file.reset();
+}
+
+// writes the subject data in voxel-major order for map_subject_matrix
+bool connectometry_db::save_subject_matrix(const std::string& file_name) const
+{
+    std::ofstream out(file_name.c_str(),std::ios::binary);
+    if(!out)
+        return false;
+    const size_t block_size = 4096;
+    std::vector<float> buf;
+    for(size_t from = 0;from < subject_qa_length;from += block_size)
+    {
+        check_prog(from,subject_qa_length);
+        size_t to = std::min<size_t>(from+block_size,subject_qa_length);
+        if(subject_matrix)
+        {
+            out.write((const char*)get_subject_column(from),(to-from)*num_subjects*sizeof(float));
+            continue;
+        }
+        buf.resize((to-from)*num_subjects);
+        for(size_t pos = from,i = 0;pos < to;++pos)
+            for(unsigned int subject_index = 0;subject_index < num_subjects;++subject_index,++i)
+                buf[i] = subject_qa[subject_index][pos];
+        out.write((const char*)&buf[0],buf.size()*sizeof(float));
+    }
+    check_prog(0,0);
+    return out.good();
+}
+
+void connectometry_db::get_subject_qa(unsigned int subject_index,std::vector<float>& data) const
+{
+    data.resize(subject_qa_length);
+    if(subject_matrix)
+    {
+        for(size_t pos = 0;pos < subject_qa_length;++pos)
+            data[pos] = subject_matrix[pos*num_subjects+subject_index];
+    }
+    else
+        std::copy(subject_qa[subject_index],subject_qa[subject_index]+subject_qa_length,data.begin());
 }
 
 void connectometry_db::remove_subject(unsigned int index)
 {
-    if(index >= subject_qa.size())
+    if(index >= num_subjects)
         return;
+    load_subject_matrix();
     subject_qa.erase(subject_qa.begin()+index);
     subject_qa_sd.erase(subject_qa_sd.begin()+index);
     subject_names.erase(subject_names.begin()+index);
@@ -94,7 +224,7 @@ void connectometry_db::calculate_si2vi(void)
     }
     subject_qa_length = handle->dir.num_fiber*si2vi.size();
 }
-bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data)
+bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data) const
 {
     odf_data subject_odf;
     if(!subject_odf.read(m))
@@ -118,7 +248,7 @@ bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data)
     }
     return true;
 }
-bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name)
+bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name) const
 {
     const float* index_of_interest = 0;
     unsigned int row,col;
@@ -138,18 +268,22 @@ bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,cons
     return true;
 }
 bool connectometry_db::is_consistent(gz_mat_read& m)
+{
+    return is_consistent(m,handle->error_msg);
+}
+bool connectometry_db::is_consistent(gz_mat_read& m,std::string& error_msg) const
 {
     unsigned int row,col;
     const float* odf_buffer = 0;
     m.read("odf_vertices",row,col,odf_buffer);
     if (!odf_buffer)
     {
-        handle->error_msg = "No odf_vertices matrix in ";
+        error_msg = "No odf_vertices matrix in ";
         return false;
     }
     if(col != handle->dir.odf_table.size())
     {
-        handle->error_msg = "Inconsistent ODF dimension in ";
+        error_msg = "Inconsistent ODF dimension in ";
         return false;
     }
     for (unsigned int index = 0;index < col;++index,odf_buffer += 3)
@@ -158,7 +292,7 @@ bool connectometry_db::is_consistent(gz_mat_read& m)
            handle->dir.odf_table[index][1] != odf_buffer[1] ||
            handle->dir.odf_table[index][2] != odf_buffer[2])
         {
-            handle->error_msg = "Inconsistent ODF in ";
+            error_msg = "Inconsistent ODF in ";
             return false;
         }
     }
@@ -166,51 +300,54 @@ bool connectometry_db::is_consistent(gz_mat_read& m)
     m.read("voxel_size",row,col,voxel_size);
     if(!voxel_size)
     {
-        handle->error_msg = "No voxel_size matrix in ";
+        error_msg = "No voxel_size matrix in ";
         return false;
     }
     if(voxel_size[0] != handle->vs[0])
     {
         std::ostringstream out;
         out << "Inconsistency in image resolution. Please use a correct atlas. The atlas resolution (" << handle->vs[0] << " mm) is different from that in ";
-        handle->error_msg = out.str();
+        error_msg = out.str();
         return false;
     }
     return true;
 }
-bool connectometry_db::add_subject_file(const std::string& file_name,
-                                         const std::string& subject_name)
+// loads and samples one subject without changing the db, so that subjects can be loaded concurrently
+bool connectometry_db::load_subject_file(const std::string& file_name,
+                                         std::vector<float>& data,float& r2,
+                                         std::string& report,std::string& error_msg) const
 {
     gz_mat_read m;
     if(!m.load_from_file(file_name.c_str()))
     {
-        handle->error_msg = "failed to load subject data ";
-        handle->error_msg += file_name;
+        error_msg = "failed to load subject data ";
+        error_msg += file_name;
         return false;
     }
-    std::vector<float> new_subject_qa(subject_qa_length);
+    data.clear();
+    data.resize(subject_qa_length);
     if(index_name == "sdf" || index_name.empty())
     {
-        if(!is_consistent(m))
+        if(!is_consistent(m,error_msg))
         {
-            handle->error_msg += file_name;
+            error_msg += file_name;
             return false;
         }
-        if(!sample_odf(m,new_subject_qa))
+        if(!sample_odf(m,data))
         {
-            handle->error_msg = "Failed to read odf ";
-            handle->error_msg += file_name;
+            error_msg = "Failed to read odf ";
+            error_msg += file_name;
             return false;
         }
     }
     else
     {
-        if(!sample_index(m,new_subject_qa,index_name.c_str()))
+        if(!sample_index(m,data,index_name.c_str()))
         {
-            handle->error_msg = "Failed to sample ";
-            handle->error_msg += index_name;
-            handle->error_msg += " in ";
-            handle->error_msg += file_name;
+            error_msg = "Failed to sample ";
+            error_msg += index_name;
+            error_msg += " in ";
+            error_msg += file_name;
             return false;
         }
     }
@@ -220,15 +357,25 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
     m.read("R2",row,col,value);
     if(!value || *value != *value)
     {
-        handle->error_msg = "Invalid R2 value in ";
-        handle->error_msg += file_name;
+        error_msg = "Invalid R2 value in ";
+        error_msg += file_name;
         return false;
     }
-    R2.push_back(*value);
+    r2 = *value;
     const char* report_buf = 0;
-    if(subject_report.empty() && m.read("report",row,col,report_buf))
-        subject_report = std::string(report_buf,report_buf+row*col);
-    subject_qa_buf.push_back(std::move(new_subject_qa));
+    if(m.read("report",row,col,report_buf))
+        report = std::string(report_buf,report_buf+row*col);
+    return true;
+}
+void connectometry_db::add_subject(std::vector<float>& data,const std::string& subject_name,
+                                   float r2,const std::string& report)
+{
+    load_subject_matrix();
+    R2.push_back(r2);
+    if(subject_report.empty())
+        subject_report = report;
+    subject_qa_buf.push_back(std::vector<float>());
+    subject_qa_buf.back().swap(data);
     subject_qa.push_back(&(subject_qa_buf.back()[0]));
     subject_names.push_back(subject_name);
     subject_qa_sd.push_back(tipl::standard_deviation(subject_qa.back(),
@@ -239,6 +386,100 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
         subject_qa_sd.back() = 1.0/subject_qa_sd.back();
     num_subjects++;
     modified = true;
+}
+bool connectometry_db::add_subject_file(const std::string& file_name,
+                                         const std::string& subject_name)
+{
+    std::vector<float> data;
+    float r2 = 0.0f;
+    std::string report;
+    if(!load_subject_file(file_name,data,r2,report,handle->error_msg))
+        return false;
+    add_subject(data,subject_name,r2,report);
+    return true;
+}
+/**
+ loads the subject files with concurrent workers and appends them in the order of file_list.
+ memory_budget limits the number of subjects loaded at the same time by the size of the first file (0: no limit).
+ Each subject is reported to log when it is loaded, and subjects that fail to load or
+ fail the consistency check are skipped. Returns false if aborted or no subject is added.
+ */
+bool connectometry_db::add_subject_files(const std::vector<std::string>& file_list,
+                                         const std::vector<std::string>& subject_name_list,
+                                         unsigned int thread_count,size_t memory_budget,
+                                         std::ostream& log)
+{
+    struct subject_data{
+        bool loaded = false;
+        std::vector<float> data;
+        float r2 = 0.0f;
+        std::string report,error_msg;
+    };
+    std::vector<subject_data> subjects(file_list.size());
+    if(subjects.empty())
+    {
+        handle->error_msg = "No subject file assigned";
+        return false;
+    }
+    thread_count = std::max<unsigned int>(1,thread_count);
+    // the inflated fib file takes about four times its file size
+    size_t subject_memory = size_t(QFileInfo(file_list[0].c_str()).size())*4+subject_qa_length*sizeof(float);
+    if(memory_budget && subject_memory)
+        thread_count = std::max<size_t>(1,std::min<size_t>(thread_count,memory_budget/subject_memory));
+    thread_count = std::min<size_t>(thread_count,subjects.size());
+
+    prog_context context(current_prog());
+    std::mutex log_lock;
+    std::atomic<unsigned int> next_job(0),finished(0);
+    std::vector<std::thread> workers;
+    for(unsigned int id = 0;id < thread_count;++id)
+        workers.push_back(std::thread([&]()
+        {
+            prog_context worker_prog(&context);
+            prog_scope scope(&worker_prog);
+            for(unsigned int job;(job = next_job++) < subjects.size() && !context.aborted();++finished)
+            {
+                subject_data& cur = subjects[job];
+                try{
+                    cur.loaded = load_subject_file(file_list[job],cur.data,cur.r2,cur.report,cur.error_msg);
+                }
+                catch(const std::bad_alloc&)
+                {
+                    cur.error_msg = "Insufficient memory to load ";
+                    cur.error_msg += file_list[job];
+                }
+                if(context.aborted())
+                    break;
+                std::lock_guard<std::mutex> lock(log_lock);
+                log << subject_name_list[job] << (cur.loaded ? "\tloaded" : "\tfailed\t" + cur.error_msg) << std::endl;
+            }
+        }));
+    while(finished < subjects.size() && !context.aborted())
+    {
+        if(!check_prog(finished,subjects.size()))
+            context.abort();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    for(unsigned int i = 0;i < workers.size();++i)
+        workers[i].join();
+    check_prog(0,0);
+    if(context.aborted())
+    {
+        handle->error_msg = "Loading process aborted";
+        return false;
+    }
+    unsigned int failed = 0;
+    for(unsigned int i = 0;i < subjects.size();++i)
+        if(subjects[i].loaded)
+            add_subject(subjects[i].data,subject_name_list[i],subjects[i].r2,subjects[i].report);
+        else
+            ++failed;
+    log << subjects.size()-failed << " subjects added, " << failed << " failed" << std::endl;
+    if(failed == subjects.size())
+    {
+        handle->error_msg = subjects[0].error_msg;
+        return false;
+    }
     return true;
 }
 
@@ -249,6 +490,24 @@ void connectometry_db::get_subject_vector(unsigned int from,unsigned int to,
     unsigned int total_count = to-from;
     subject_vector.clear();
     subject_vector.resize(total_count);
+    if(subject_matrix)
+    {
+        // read the contiguous subject column of each voxel once
+        for(unsigned int s_index = 0;s_index < si2vi.size();++s_index)
+        {
+            unsigned int cur_index = si2vi[s_index];
+            if(!cerebrum_mask[cur_index])
+                continue;
+            for(unsigned int j = 0,fib_offset = 0;j < handle->dir.num_fiber && handle->dir.fa[j][cur_index] > fiber_threshold;
+                    ++j,fib_offset+=si2vi.size())
+            {
+                const float* column = get_subject_column(s_index + fib_offset)+from;
+                for(unsigned int index = 0;index < total_count;++index)
+                    subject_vector[index].push_back(column[index]);
+            }
+        }
+    }
+    else
     tipl::par_for(total_count,[&](unsigned int index)
     {
         unsigned int subject_index = index + from;
@@ -282,7 +541,7 @@ void connectometry_db::get_subject_vector(unsigned int subject_index,std::vector
             continue;
         for(unsigned int j = 0,fib_offset = 0;j < handle->dir.num_fiber && handle->dir.fa[j][cur_index] > fiber_threshold;
                 ++j,fib_offset+=si2vi.size())
-            subject_vector.push_back(subject_qa[subject_index][s_index + fib_offset]);
+            subject_vector.push_back(get_subject_value(subject_index,s_index + fib_offset));
     }
     if(normalize_fp)
     {
@@ -389,7 +648,11 @@ void connectometry_db::save_subject_vector(const char* output_name,
     }
     check_prog(0,0);
 }
-bool connectometry_db::save_subject_data(const char* output_name)
+/**
+ voxel_major: the subject data are written to output_name.subject_matrix in voxel-major order
+              and memory-mapped when the db is opened, so that the db does not need to fit in memory.
+ */
+bool connectometry_db::save_subject_data(const char* output_name,bool voxel_major)
 {
     // store results
     gz_mat_write matfile(output_name);
@@ -402,11 +665,41 @@ bool connectometry_db::save_subject_data(const char* output_name)
         if(handle->mat_reader[index].get_name() != "report" &&
            handle->mat_reader[index].get_name().find("subject") != 0)
             matfile.write(handle->mat_reader[index]);
-    for(unsigned int index = 0;check_prog(index,(unsigned int)subject_qa.size());++index)
+    if(voxel_major)
     {
-        std::ostringstream out;
-        out << "subject" << index;
-        matfile.write(out.str().c_str(),subject_qa[index],handle->dir.num_fiber,(unsigned int)si2vi.size());
+        std::string matrix_file = output_name;
+        matrix_file += ".subject_matrix";
+        if(subject_matrix && QFileInfo(matrix_file.c_str()) == QFileInfo(subject_matrix_file->fileName()))
+        {
+            handle->error_msg = "Cannot overwrite the subject matrix in use";
+            return false;
+        }
+        if(!save_subject_matrix(matrix_file))
+        {
+            handle->error_msg = "Cannot output subject matrix";
+            return false;
+        }
+        matrix_file = QFileInfo(matrix_file.c_str()).fileName().toStdString();
+        matfile.write("subject_matrix",matrix_file.c_str(),1,(unsigned int)matrix_file.size());
+        matfile.write("subject_qa_sd",&*subject_qa_sd.begin(),1,(unsigned int)subject_qa_sd.size());
+    }
+    else
+    {
+        std::vector<float> buf;
+        for(unsigned int index = 0;check_prog(index,num_subjects);++index)
+        {
+            std::ostringstream out;
+            out << "subject" << index;
+            const float* data = 0;
+            if(subject_matrix)
+            {
+                get_subject_qa(index,buf);
+                data = &buf[0];
+            }
+            else
+                data = subject_qa[index];
+            matfile.write(out.str().c_str(),data,handle->dir.num_fiber,(unsigned int)si2vi.size());
+        }
     }
     std::string name_string;
     for(unsigned int index = 0;index < num_subjects;++index)
@@ -439,7 +732,7 @@ void connectometry_db::get_subject_slice(unsigned int subject_index,unsigned cha
     slice.resize(tmp.geometry());
     for(unsigned int index = 0;index < slice.size();++index)
         if(tmp[index])
-            slice[index] = subject_qa[subject_index][tmp[index]];
+            slice[index] = get_subject_value(subject_index,tmp[index]);
 }
 void connectometry_db::get_subject_fa(unsigned int subject_index,std::vector<std::vector<float> >& fa_data) const
 {
@@ -452,7 +745,7 @@ void connectometry_db::get_subject_fa(unsigned int subject_index,std::vector<std
         for(unsigned int i = 0,fib_offset = 0;i < handle->dir.num_fiber && handle->dir.fa[i][cur_index] > 0;++i,fib_offset+=(unsigned int)si2vi.size())
         {
             unsigned int pos = s_index + fib_offset;
-            fa_data[i][cur_index] = subject_qa[subject_index][pos];
+            fa_data[i][cur_index] = get_subject_value(subject_index,pos);
         }
     }
 }
@@ -464,6 +757,15 @@ void connectometry_db::get_data_at(unsigned int index,unsigned int fib_index,std
     unsigned int s_index = vi2si[index];
     unsigned int fib_offset = fib_index*(unsigned int)si2vi.size();
     data.resize(num_subjects);
+    if(subject_matrix)
+    {
+        const float* column = get_subject_column(s_index+fib_offset);
+        std::copy(column,column+num_subjects,data.begin());
+        if(normalize_qa)
+            for(unsigned int index = 0;index < num_subjects;++index)
+                data[index] *= subject_qa_sd[index];
+        return;
+    }
     if(normalize_qa)
         for(unsigned int index = 0;index < num_subjects;++index)
             data[index] = subject_qa[index][s_index+fib_offset]*subject_qa_sd[index];
@@ -554,25 +856,22 @@ void connectometry_db::read_subject_qa(std::vector<std::vector<float> >&data) co
 {
     data.resize(num_subjects);
     for(unsigned int i = 0;i < num_subjects;++i)
-    {
-        std::vector<float> buf(subject_qa[i],subject_qa[i]+subject_qa_length);
-        data[i].swap(buf);
-    }
+        get_subject_qa(i,data[i]);
 }
 
 bool connectometry_db::add_db(const connectometry_db& rhs)
 {
     if(!is_db_compatible(rhs))
         return false;
+    load_subject_matrix();
     R2.insert(R2.end(),rhs.R2.begin(),rhs.R2.end());
     subject_qa_sd.insert(subject_qa_sd.end(),rhs.subject_qa_sd.begin(),rhs.subject_qa_sd.end());
     subject_names.insert(subject_names.end(),rhs.subject_names.begin(),rhs.subject_names.end());
     // copy the qa memeory
     for(unsigned int index = 0;index < rhs.num_subjects;++index)
     {
-        subject_qa_buf.push_back(std::vector<float>(subject_qa_length));
-        std::copy(rhs.subject_qa[index],
-                  rhs.subject_qa[index]+subject_qa_length,subject_qa_buf.back().begin());
+        subject_qa_buf.push_back(std::vector<float>());
+        rhs.get_subject_qa(index,subject_qa_buf.back());
         subject_qa.push_back(&(subject_qa_buf.back()[0]));
     }
     num_subjects += rhs.num_subjects;
@@ -583,6 +882,7 @@ void connectometry_db::move_up(int id)
 {
     if(id == 0)
         return;
+    load_subject_matrix();
     std::swap(subject_names[id],subject_names[id-1]);
     std::swap(R2[id],R2[id-1]);
     std::swap(subject_qa[id],subject_qa[id-1]);
@@ -593,6 +893,7 @@ void connectometry_db::move_down(int id)
 {
     if(id >= num_subjects-1)
         return;
+    load_subject_matrix();
     std::swap(subject_names[id],subject_names[id+1]);
     std::swap(R2[id],R2[id+1]);
     std::swap(subject_qa[id],subject_qa[id+1]);
@@ -643,6 +944,7 @@ void connectometry_db::calculate_change(unsigned char dif_type,bool norm)
 
     std::list<std::vector<float> > new_subject_qa_buf;
     std::vector<const float*> new_subject_qa;
+    load_subject_matrix();
     begin_prog("calculating");
     for(unsigned int index = 0;check_prog(index,match.size());++index)
     {
@@ -720,7 +1022,7 @@ void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,s
                    float fiber_threshold,bool normalize_qa,bool& terminated)
 {
     data.initialize(handle);
-    std::vector<double> population(handle->db.subject_qa.size());
+    std::vector<double> population(handle->db.num_subjects);
     for(unsigned int s_index = 0;s_index < handle->db.si2vi.size() && !terminated;++s_index)
     {
         unsigned int cur_index = handle->db.si2vi[s_index];
@@ -728,6 +1030,13 @@ void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,s
                 ++fib,fib_offset+=handle->db.si2vi.size())
         {
             unsigned int pos = s_index + fib_offset;
+            if(handle->db.is_mapped())
+            {
+                const float* column = handle->db.get_subject_column(pos);
+                for(unsigned int index = 0;index < population.size();++index)
+                    population[index] = normalize_qa ? column[index]*handle->db.subject_qa_sd[index] : column[index];
+            }
+            else
             if(normalize_qa)
                 for(unsigned int index = 0;index < population.size();++index)
                     population[index] = handle->db.subject_qa[index][pos]*handle->db.subject_qa_sd[index];
@@ -1073,9 +1382,9 @@ void stat_model::remove_missing_data(double missing_value)
     }
 }
 
-bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
+template<class rand_type>
+bool stat_model::resample(const stat_model& rhs,bool null,bool bootstrap,rand_type& rand_gen)
 {
-    std::lock_guard<std::mutex> lock(rhs.lock_random);
     *this = rhs;
     unsigned int trial = 0;
     do
@@ -1100,7 +1409,7 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
             {
                 unsigned int new_index = index;
                 if(bootstrap)
-                    new_index = rhs.label[index] ? group1[rhs.rand_gen(group1.size())]:group0[rhs.rand_gen(group0.size())];
+                    new_index = rhs.label[index] ? group1[rand_gen(group1.size())]:group0[rand_gen(group0.size())];
                 subject_index[index] = rhs.subject_index[new_index];
                 label[index] = rhs.label[new_index];
             }
@@ -1110,7 +1419,7 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
             X.resize(rhs.X.size());
             for(unsigned int index = 0,pos = 0;index < rhs.subject_index.size();++index,pos += feature_count)
             {
-                unsigned int new_index = bootstrap ? rhs.rand_gen(rhs.subject_index.size()) : index;
+                unsigned int new_index = bootstrap ? rand_gen(rhs.subject_index.size()) : index;
                 subject_index[index] = rhs.subject_index[new_index];
                 std::copy(rhs.X.begin()+new_index*feature_count,
                           rhs.X.begin()+new_index*feature_count+feature_count,X.begin()+pos);
@@ -1120,17 +1429,27 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
         case 2: // individual
             for(unsigned int index = 0;index < rhs.subject_index.size();++index)
             {
-                unsigned int new_index = bootstrap ? rhs.rand_gen(rhs.subject_index.size()) : index;
+                unsigned int new_index = bootstrap ? rand_gen(rhs.subject_index.size()) : index;
                 subject_index[index] = rhs.subject_index[new_index];
             }
             break;
         }
         if(null)
-            std::random_shuffle(subject_index.begin(),subject_index.end(),rhs.rand_gen);
+            std::random_shuffle(subject_index.begin(),subject_index.end(),rand_gen);
     }while(!pre_process());
 
     return true;
 }
+bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
+{
+    std::lock_guard<std::mutex> lock(rhs.lock_random);
+    return resample(rhs,null,bootstrap,rhs.rand_gen);
+}
+bool stat_model::resample(const stat_model& rhs,bool null,bool bootstrap,std::mt19937& gen)
+{
+    auto rand_gen = [&](int size){return std::uniform_int_distribution<int>(0,size-1)(gen);};
+    return resample(rhs,null,bootstrap,rand_gen);
+}
 void stat_model::select(const std::vector<double>& population,std::vector<double>& selected_population) const
 {
     for(unsigned int index = 0;index < subject_index.size();++index)
@@ -2,9 +2,12 @@
 #define CONNECTOMETRY_DB_H
 #include <vector>
 #include <string>
+#include <memory>
+#include <random>
 #include "gzip_interface.hpp"
 #include "tipl/tipl.hpp"
 class fib_data;
+class QFile;
 class connectometry_db
 {
 public:
@@ -17,6 +20,19 @@ public:// subject specific data
     std::vector<float> R2;
     std::vector<const float*> subject_qa;
     std::vector<float> subject_qa_sd;
+public:// voxel-major subject matrix mapped from the file named in "subject_matrix"
+    std::shared_ptr<QFile> subject_matrix_file;
+    const float* subject_matrix = 0;// subject_matrix[pos*num_subjects+subject_index]
+    bool is_mapped(void) const{return subject_matrix != 0;}
+    const float* get_subject_column(unsigned int pos) const{return subject_matrix+size_t(pos)*num_subjects;}
+    float get_subject_value(unsigned int subject_index,unsigned int pos) const
+    {
+        return subject_matrix ? subject_matrix[size_t(pos)*num_subjects+subject_index] : subject_qa[subject_index][pos];
+    }
+    void get_subject_qa(unsigned int subject_index,std::vector<float>& data) const;
+    bool map_subject_matrix(const std::string& file_name);
+    void load_subject_matrix(void);
+    bool save_subject_matrix(const std::string& file_name) const;
 public:
     std::list<std::vector<float> > subject_qa_buf;// merged from other db
     unsigned int subject_qa_length;
@@ -33,11 +49,20 @@ public:
     void read_db(fib_data* handle);
     void remove_subject(unsigned int index);
     void calculate_si2vi(void);
-    bool sample_odf(gz_mat_read& m,std::vector<float>& data);
-    bool sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name);
+    bool sample_odf(gz_mat_read& m,std::vector<float>& data) const;
+    bool sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name) const;
     bool is_consistent(gz_mat_read& m);
+    bool is_consistent(gz_mat_read& m,std::string& error_msg) const;
+    bool load_subject_file(const std::string& file_name,std::vector<float>& data,float& r2,
+                           std::string& report,std::string& error_msg) const;
+    void add_subject(std::vector<float>& data,const std::string& subject_name,
+                     float r2,const std::string& report);
     bool add_subject_file(const std::string& file_name,
                             const std::string& subject_name);
+    bool add_subject_files(const std::vector<std::string>& file_list,
+                           const std::vector<std::string>& subject_name_list,
+                           unsigned int thread_count,size_t memory_budget,
+                           std::ostream& log);
     void get_subject_vector(unsigned int from,unsigned int to,
                             std::vector<std::vector<float> >& subject_vector,
                             const tipl::image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp) const;
@@ -48,7 +73,7 @@ public:
                              const tipl::image<int,3>& cerebrum_mask,
                              float fiber_threshold,
                              bool normalize_fp) const;
-    bool save_subject_data(const char* output_name);
+    bool save_subject_data(const char* output_name,bool voxel_major = false);
     void get_subject_slice(unsigned int subject_index,unsigned char dim,unsigned int pos,
                             tipl::image<float,2>& slice) const;
     void get_subject_fa(unsigned int subject_index,std::vector<std::vector<float> >& fa_data) const;
@@ -93,6 +118,10 @@ public:
     void remove_subject(unsigned int index);
     void remove_missing_data(double missing_value);
     bool resample(stat_model& rhs,bool null,bool bootstrap);
+    // uses gen instead of the shared generator, so that each permutation can be reproduced
+    bool resample(const stat_model& rhs,bool null,bool bootstrap,std::mt19937& gen);
+    template<class rand_type>
+    bool resample(const stat_model& rhs,bool null,bool bootstrap,rand_type& rand_gen);
     bool pre_process(void);
     void select(const std::vector<double>& population,std::vector<double>& selected_population)const;
     double operator()(const std::vector<double>& population,unsigned int pos) const;
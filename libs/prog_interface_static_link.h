@@ -1,5 +1,7 @@
 #ifndef PROG_INTERFACE_STATIC_LINKH
 #define PROG_INTERFACE_STATIC_LINKH
+#include <atomic>
+#include <vector>
 
 
 void begin_prog(const char* title,bool lock = false);
@@ -8,5 +10,43 @@ void set_title(const char* title);
 bool check_prog(unsigned int now,unsigned int total);
 bool prog_aborted(void);
 bool is_running(void);
+
+// per-task progress and cancellation token
+// worker threads poll aborted() with an atomic read. Aborting a context
+// aborts all of its children, and the parent reports the average
+// progress of its children, so concurrent pipelines do not interfere.
+// A context detaches its children when destroyed, so a child may outlive its parent.
+class prog_context{
+private:
+    prog_context* parent;
+    std::vector<prog_context*> children;
+    std::atomic<bool> aborted_;
+    std::atomic<unsigned int> now_,total_;
+    void abort_tree(void);
+    float progress_tree(void) const;
+public:
+    prog_context(prog_context* parent_ = 0);
+    ~prog_context(void);
+    void abort(void);
+    bool aborted(void) const{return aborted_.load(std::memory_order_relaxed);}
+    bool check(unsigned int now,unsigned int total)
+    {
+        now_.store(now,std::memory_order_relaxed);
+        total_.store(total,std::memory_order_relaxed);
+        return now < total && !aborted();
+    }
+    float progress(void) const;
+};
+
+// binds a context to the calling thread. While bound, begin_prog/check_prog/prog_aborted
+// report to the context instead of the shared progress dialog.
+class prog_scope{
+private:
+    prog_context* prev;
+public:
+    prog_scope(prog_context* context);
+    ~prog_scope(void);
+};
+prog_context* current_prog(void);
 #endif
 
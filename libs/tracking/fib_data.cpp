@@ -454,6 +454,7 @@ bool fib_data::load_from_file(const char* file_name)
         view_item[0].name = "image";
         return true;
     }
+    fib_file_name = file_name;
     if (!mat_reader.load_from_file(file_name) || prog_aborted())
     {
         error_msg = prog_aborted() ? "Loading process aborted" : "Invalid file format";
@@ -493,13 +494,11 @@ bool fib_data::load_from_mat(void)
     view_item.push_back(item());
     view_item.back().name =  dir.fa.size() == 1 ? "fa":"qa";
     view_item.back().image_data = tipl::make_image(dir.fa[0],dim);
-    view_item.back().set_scale(dir.fa[0],dir.fa[0]+dim.size());
     for(unsigned int index = 1;index < dir.index_name.size();++index)
     {
         view_item.push_back(item());
         view_item.back().name =  dir.index_name[index];
         view_item.back().image_data = tipl::make_image(dir.index_data[index][0],dim);
-        view_item.back().set_scale(dir.index_data[index][0],dir.index_data[index][0]+dim.size());
     }
     view_item.push_back(item());
     view_item.back() = view_item[0];
@@ -549,7 +548,6 @@ bool fib_data::load_from_mat(void)
         view_item.push_back(item());
         view_item.back().name = matrix_name;
         view_item.back().image_data = tipl::make_image(buf,dim);
-        view_item.back().set_scale(buf,buf+dim.size());
     }
     if (!dim[2])
     {
@@ -640,7 +638,8 @@ std::pair<float,float> fib_data::get_value_range(const std::string& view_name) c
     if(view_index == view_item.size())
         return std::make_pair((float)0.0,(float)0.0);
     if(view_item[view_index].name == "color")
-        return std::make_pair(view_item[0].min_value,view_item[0].max_value);
+        view_index = 0;
+    view_item[view_index].check_scale();
     return std::make_pair(view_item[view_index].min_value,view_item[view_index].max_value);
 }
 
@@ -826,7 +825,7 @@ void fib_data::get_atlas_roi(int atlas_index,int roi_index,std::vector<tipl::vec
     if(get_mni_mapping().empty())
         return;
     // this will load the files from storage to prevent GUI multishread crash
-    atlas_list[atlas_index].is_labeled_as(tipl::vector<3>(0,0,0), roi_index);
+    atlas_list[atlas_index].load();
     unsigned int thread_count = std::thread::hardware_concurrency();
     std::vector<std::vector<tipl::vector<3,short> > > buf(thread_count);
     r = 1.0;
@@ -845,6 +844,7 @@ void fib_data::get_atlas_roi(int atlas_index,int roi_index,std::vector<tipl::vec
 }
 const tipl::image<tipl::vector<3,float>,3 >& fib_data::get_mni_mapping(void)
 {
+    std::lock_guard<std::mutex> lock(lock_mni);
     if(!mni_position.empty())
         return mni_position;
     if(is_qsdr)
@@ -864,24 +864,30 @@ void smoothed_tracks(const std::vector<float>& track,std::vector<float>& smoothe
 void resample_tracks(const std::vector<float>& track,std::vector<float>& new_track,float interval);
 bool fib_data::get_profile(const std::vector<float>& tract,
                  std::vector<float>& profile_)
+{
+    profile_workspace buf;
+    return get_profile(tract,profile_,buf);
+}
+bool fib_data::get_profile(const std::vector<float>& tract,
+                 std::vector<float>& profile_,profile_workspace& buf)
 {
     if(tract.size() < 6)
         return false;
-    std::vector<float> tract_data;
-
+    std::vector<float>& tract_data = buf.resampled;
+    tract_data.clear();
     {
-        std::vector<float> smoothed_track_in_mni;
-        std::vector<float> tract_in_mni;
+        std::vector<float>& tract_in_mni = buf.tract_in_mni;
+        tract_in_mni.resize(tract.size());
         for(int j = 0;j < tract.size();j += 3)
         {
             tipl::vector<3> v(&(tract[j]));
             subject2mni(v);
-            tract_in_mni.push_back(v[0]);
-            tract_in_mni.push_back(v[1]);
-            tract_in_mni.push_back(v[2]);
+            tract_in_mni[j] = v[0];
+            tract_in_mni[j+1] = v[1];
+            tract_in_mni[j+2] = v[2];
         }
-        smoothed_tracks(tract_in_mni,smoothed_track_in_mni);
-        resample_tracks(smoothed_track_in_mni,tract_data,0.5);
+        smoothed_tracks(tract_in_mni,buf.smoothed);
+        resample_tracks(buf.smoothed,tract_data,0.5);
     }
 
     tipl::geometry<3> dim(60,75,3);
@@ -3,6 +3,9 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include "prog_interface_static_link.h"
 #include "tipl/tipl.hpp"
 #include "gzip_interface.hpp"
@@ -90,15 +93,25 @@ public:
 
 
 
+// an atomic flag that is copied along with the item holding it
+struct copyable_flag{
+    std::atomic<bool> value;
+    copyable_flag(bool value_ = false):value(value_){}
+    copyable_flag(const copyable_flag& rhs):value(rhs.value.load()){}
+    copyable_flag& operator=(const copyable_flag& rhs){value = rhs.value.load();return *this;}
+};
+
 struct item
 {
     std::string name;
     tipl::const_pointer_image<float,3> image_data;
     tipl::matrix<4,4,float> T,iT;// T: image->diffusion iT: diffusion->image
-    float max_value;
-    float min_value;
-    float contrast_max;
-    float contrast_min;
+    // value range is computed on first use (see check_scale) to keep file opening fast
+    mutable float max_value;
+    mutable float min_value;
+    mutable float contrast_max;
+    mutable float contrast_min;
+    mutable copyable_flag has_scale;
     unsigned int max_color = 0x00FFFFFF;
     unsigned int min_color = 0;
     // used in QSDR
@@ -108,8 +121,15 @@ struct item
 
 
     template<class input_iterator>
-    void set_scale(input_iterator from,input_iterator to)
+    void set_scale(input_iterator from,input_iterator to) const
     {
+        if(from == to)
+        {
+            contrast_min = min_value = 0;
+            contrast_max = max_value = 1;
+            has_scale.value.store(true,std::memory_order_release);
+            return;
+        }
         contrast_max = max_value = *std::max_element(from,to);
         contrast_min = min_value = *std::min_element(from,to);
         if(max_value == min_value)
@@ -117,15 +137,31 @@ struct item
             min_value = 0;
             max_value = 1;
         }
-
+        has_scale.value.store(true,std::memory_order_release);
+    }
+    // safe to call from multiple threads sharing the fib data
+    void check_scale(void) const
+    {
+        if(has_scale.value.load(std::memory_order_acquire))
+            return;
+        static std::mutex scale_lock;
+        std::lock_guard<std::mutex> lock(scale_lock);
+        if(!has_scale.value.load(std::memory_order_relaxed))
+            set_scale(image_data.begin(),image_data.end());
     }
 };
 
+// buffers used by fib_data::get_profile, reused across tracts by the caller
+struct profile_workspace{
+    std::vector<float> tract_in_mni,smoothed,resampled;
+};
+
 class fib_data
 {
 public:
     mutable std::string error_msg;
     std::string report;
+    std::string fib_file_name;
     gz_mat_read mat_reader;
 public:
     tipl::geometry<3> dim;
@@ -139,6 +175,7 @@ public:
     std::vector<item> view_item;
 public:
     tipl::thread thread;
+    std::mutex lock_mni;
     int prog;
     std::vector<float> trans_to_mni;
     tipl::image<tipl::vector<3,float>,3 > mni_position;
@@ -152,6 +189,8 @@ public:
     bool has_reg(void)const{return thread.has_started();}
     bool get_profile(const std::vector<float>& tract_data,
                      std::vector<float>& profile);
+    bool get_profile(const std::vector<float>& tract_data,
+                     std::vector<float>& profile,profile_workspace& buf);
 
 public:
     fib_data(void)
@@ -194,6 +233,34 @@ public:
     std::vector<std::string> track_list;
     std::vector<std::string> track_name;
     bool can_recognize(void);
+    // classifies tracts in blocks. Each tract still goes through cnn.predict on its own; the
+    // profiles of a block are built and predicted in parallel with per-thread buffers, then
+    // fun(tract_index,output) is called in tract order for each tract that has a profile.
+    template<class fun_type>
+    void predict(fib_data* handle,const std::vector<std::vector<float> >& tracts,fun_type fun)
+    {
+        const unsigned int batch_size = 4096;
+        unsigned int output_size = cnn.get_output_size();
+        std::vector<std::vector<float> > input(std::thread::hardware_concurrency());
+        std::vector<profile_workspace> buf(input.size());
+        std::vector<float> output(batch_size*output_size);
+        std::vector<unsigned char> has_output(batch_size);
+        for(size_t from = 0;from < tracts.size();from += batch_size)
+        {
+            unsigned int size = std::min<size_t>(batch_size,tracts.size()-from);
+            tipl::par_for2(size,[&](unsigned int i,unsigned int id)
+            {
+                has_output[i] = handle->get_profile(tracts[from+i],input[id],buf[id]);
+                if(!has_output[i])
+                    return;
+                cnn.predict(input[id]);
+                std::copy(input[id].begin(),input[id].begin()+output_size,output.begin()+i*output_size);
+            });
+            for(unsigned int i = 0;i < size;++i)
+                if(has_output[i])
+                    fun(from+i,&output[i*output_size]);
+        }
+    }
 public:
     void clear(void);
     void add_label(const std::string& name){cnn_name.push_back(name);}
@@ -30,6 +30,19 @@ typedef boost::mpl::vector<
 
 
 
+// outcome of a seed, collected per thread for diagnostics and benchmarking
+enum termination_type{
+    track_accepted = 0,
+    track_too_long,
+    track_excluded,
+    track_too_short,
+    track_no_include,
+    track_no_end,
+    track_seed_rejected,
+    track_ending_rejected,
+    termination_type_count
+};
+
 struct TrackingParam
 {
     float threshold;
@@ -156,6 +169,7 @@ public:// Parameters
     tipl::vector<3,float> next_dir;
     bool terminated;
     bool forward;
+    unsigned char termination;
 public:
     const tracking_data& trk;
     float current_fa_threshold;
@@ -197,7 +211,7 @@ public:
 public:
     TrackingMethod(const tracking_data& trk_,basic_interpolation* interpolation_,
                    const RoiMgr& roi_mgr_):
-        trk(trk_),interpolation(interpolation_),roi_mgr(roi_mgr_),init_fib_index(0)
+        interpolation(interpolation_),termination(track_accepted),trk(trk_),roi_mgr(roi_mgr_),init_fib_index(0)
 	{
 
 
@@ -234,9 +248,15 @@ public:
 		do
 		{
             if(get_buffer_size() > current_max_steps3 || buffer_back_pos + 3 >= track_buffer.size())
-				return false;
+            {
+                termination = track_too_long;
+                return false;
+            }
             if(roi_mgr.is_excluded_point(position))
-				return false;
+            {
+                termination = track_excluded;
+                return false;
+            }
             track_buffer[buffer_back_pos] = position[0];
             track_buffer[buffer_back_pos+1] = position[1];
             track_buffer[buffer_back_pos+2] = position[2];
@@ -259,12 +279,18 @@ public:
             tracking(ProcessList());
 			// make sure that the length won't overflow
             if(get_buffer_size() > current_max_steps3 || buffer_front_pos < 3)
-				return false;			
+            {
+                termination = track_too_long;
+                return false;
+            }
             if(terminated)
 				break;
 			buffer_front_pos -= 3;
             if(roi_mgr.is_excluded_point(position))
-				return false;
+            {
+                termination = track_excluded;
+                return false;
+            }
             track_buffer[buffer_front_pos] = position[0];
             track_buffer[buffer_front_pos+1] = position[1];
             track_buffer[buffer_front_pos+2] = position[2];
@@ -294,9 +320,17 @@ public:
             smoothed.swap(track_buffer);
         }
 
-        return get_buffer_size() > current_min_steps3 &&
-               roi_mgr.have_include(get_result(),get_buffer_size()) &&
-               roi_mgr.fulfill_end_point(position,end_point1);
+        if(get_buffer_size() <= current_min_steps3)
+            termination = track_too_short;
+        else
+        if(!roi_mgr.have_include(get_result(),get_buffer_size()))
+            termination = track_no_include;
+        else
+        if(!roi_mgr.fulfill_end_point(position,end_point1))
+            termination = track_no_end;
+        else
+            termination = track_accepted;
+        return termination == track_accepted;
 
 
 	}
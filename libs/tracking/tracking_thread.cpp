@@ -43,7 +43,7 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,
     if(!roi_mgr.seeds.empty())
     try{
         std::vector<std::vector<float> > local_track_buffer;
-        while(!joinning &&
+        while(!joinning && !(prog && prog->aborted()) &&
               (!param.stop_by_tract || tract_count[thread_id] < max_count) &&
               (param.stop_by_tract || seed_count[thread_id] < max_count) &&
               (param.max_seed_count == 0 || seed_count[thread_id] < param.max_seed_count) &&
@@ -78,6 +78,7 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,
                                            roi_mgr.seeds[iteration].z()/roi_mgr.seeds_r[iteration]),
                                  seed))
                 {
+                    ++termination_hist[thread_id][track_seed_rejected];
                     iteration+=thread_count;
                     continue;
                 }
@@ -97,24 +98,36 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,
                 if(roi_mgr.seeds_r[i] != 1.0f)
                     pos /= roi_mgr.seeds_r[i];
                 if(!method->init(param.initial_direction,pos,seed))
+                {
+                    ++termination_hist[thread_id][track_seed_rejected];
                     continue;
+                }
             }
             unsigned int point_count;
             const float *result = method->tracking(param.tracking_method,point_count);
             if(!result)
+            {
+                ++termination_hist[thread_id][method->termination];
                 continue;
+            }
             const float* end = result+point_count+point_count+point_count;
             if(param.check_ending)
             {
                 if(point_count < 2)
+                {
+                    ++termination_hist[thread_id][track_ending_rejected];
                     continue;
+                }
                 if(result[2] > 0) // not the bottom slice
                 {
                     tipl::vector<3> p0(result),p1(result+3);
                     p1 -= p0;
                     p0 -= p1;
                     if(method->trk.is_white_matter(p0,white_matter_t))
+                    {
+                        ++termination_hist[thread_id][track_ending_rejected];
                         continue;
+                    }
                 }
                 tipl::vector<3> p2(end-6),p3(end-3);
                 if(*(end-1) > 0) // not the bottom slice
@@ -122,9 +135,13 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,
                     p2 -= p3;
                     p3 -= p2;
                     if(method->trk.is_white_matter(p3,white_matter_t))
+                    {
+                        ++termination_hist[thread_id][track_ending_rejected];
                         continue;
+                    }
                 }
             }
+            ++termination_hist[thread_id][track_accepted];
             ++tract_count[thread_id];
             local_track_buffer.push_back(std::vector<float>(result,end));
         }
@@ -211,6 +228,8 @@ void ThreadData::run(const tracking_data& trk,
     tract_count.clear();
     seed_count.resize(thread_count);
     tract_count.resize(thread_count);
+    termination_hist.clear();
+    termination_hist.resize(thread_count,std::vector<unsigned int>(termination_type_count));
     running.resize(thread_count);
     pushing_data = false;
     std::fill(running.begin(),running.end(),1);
@@ -9,6 +9,7 @@
 #include "tracking_method.hpp"
 #include "fib_data.hpp"
 #include "tract_model.hpp"
+#include "prog_interface_static_link.h"
 
 struct ThreadData
 {
@@ -24,7 +25,7 @@ public:
     float fa_threshold1,fa_threshold2;// use only if fa_threshold=0
 
 public:
-    ThreadData(void):joinning(false),seed(0){}
+    ThreadData(void):joinning(false),seed(0),prog(current_prog()){}
     ~ThreadData(void)
     {
         end_thread();
@@ -32,11 +33,13 @@ public:
 public:
     bool joinning = false;
     bool pushing_data = false;
+    prog_context* prog = 0; // the task that owns this tracking, captured at construction
 
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::vector<unsigned int> seed_count;
     std::vector<unsigned int> tract_count;
     std::vector<unsigned char> running;
+    std::vector<std::vector<unsigned int> > termination_hist;// [thread][termination_type]
     std::mutex  lock_feed_function,lock_seed_function;
     unsigned int get_total_seed_count(void)const
     {
@@ -50,6 +53,14 @@ public:
             return 0;
         return std::accumulate(tract_count.begin(),tract_count.end(),0);
     }
+    void get_termination_hist(std::vector<unsigned int>& hist) const
+    {
+        hist.clear();
+        hist.resize(termination_type_count);
+        for(unsigned int i = 0;i < termination_hist.size();++i)
+            for(unsigned int j = 0;j < termination_hist[i].size() && j < hist.size();++j)
+                hist[j] += termination_hist[i][j];
+    }
     bool is_ended(void)
     {
         if(running.empty())
@@ -5,6 +5,7 @@
 #include <iterator>
 #include <set>
 #include <map>
+#include <thread>
 #include "roi.hpp"
 #include "tract_model.hpp"
 #include "prog_interface_static_link.h"
@@ -1644,15 +1645,19 @@ void TractModel::get_quantitative_data(std::vector<float>& data)
         data.push_back(pass_map.size()*voxel_volume);
     }
 
-    // output mean and std of each index
-    for(int data_index = 0;data_index < handle->view_item.size();++data_index)
+    // output mean and std of each index, sampled together in one pass
     {
-        if(handle->view_item[data_index].name == "color")
-            continue;
-        float mean,sd;
-        get_tracts_data(data_index,mean,sd);
-        data.push_back(mean);
-        data.push_back(sd);
+        std::vector<unsigned int> index_list;
+        for(unsigned int data_index = 0;data_index < handle->view_item.size();++data_index)
+            if(handle->view_item[data_index].name != "color")
+                index_list.push_back(data_index);
+        std::vector<float> mean,sd;
+        get_tracts_data(index_list,mean,sd);
+        for(unsigned int i = 0;i < index_list.size();++i)
+        {
+            data.push_back(mean[i]);
+            data.push_back(sd[i]);
+        }
     }
 }
 
@@ -1699,16 +1704,14 @@ bool TractModel::recognize(std::map<float,std::string,std::greater<float> >& res
 {
     if(!track_network.can_recognize())
         return false;
-    std::vector<float> accu_input(track_network.cnn.get_output_size());
-    tipl::par_for(tract_data.size(),[&](int i)
-    {
-        std::vector<float> input;
-        if(!handle->get_profile(tract_data[i],input))
-            return;
-        track_network.cnn.predict(input);
-        tipl::minus_constant(input,*std::min_element(input.begin(),input.end()));
-        tipl::multiply_constant(input,1.0f/std::accumulate(input.begin(),input.end(),0.0f));
-        tipl::add(accu_input,input);
+    unsigned int output_size = track_network.cnn.get_output_size();
+    std::vector<float> accu_input(output_size);
+    track_network.predict(handle.get(),tract_data,[&](size_t,const float* output)
+    {
+        float min_value = *std::min_element(output,output+output_size);
+        float sum = std::accumulate(output,output+output_size,0.0f)-min_value*output_size;
+        for(unsigned int j = 0;j < output_size;++j)
+            accu_input[j] += (output[j]-min_value)/sum;
     });
     tipl::multiply_constant(accu_input,1.0f/std::accumulate(accu_input.begin(),accu_input.end(),0.0f));
     for(int i = 0;i < accu_input.size();++i)
@@ -1762,15 +1765,15 @@ void TractModel::recognize_report(std::string& report)
     */
     if(!handle->is_human_data || !track_network.can_recognize())
         return;
-    std::vector<int> recog_count(track_network.cnn.get_output_size());
-    tipl::par_for(tract_data.size(),[&](int i)
-    {
-        std::vector<float> input;
-        if(!handle->get_profile(tract_data[i],input))
-            return;
-        track_network.cnn.predict(input);
-        input[80] = -100;// suppress false tracks ID:20
-        ++recog_count[std::max_element(input.begin(),input.end())-input.begin()];
+    unsigned int output_size = track_network.cnn.get_output_size();
+    std::vector<int> recog_count(output_size);
+    track_network.predict(handle.get(),tract_data,[&](size_t,const float* output)
+    {
+        unsigned int label = 0;
+        for(unsigned int j = 1;j < output_size;++j)
+            if(j != 80 && output[j] > output[label]) // suppress false tracks ID:20
+                label = j;
+        ++recog_count[label];
     });
     {
         std::map<int,std::string,std::greater<int> > sorted_result;
@@ -1966,6 +1969,52 @@ void TractModel::get_tract_data(unsigned int fiber_index,unsigned int index_num,
     }
 }
 
+void TractModel::get_tract_data(unsigned int fiber_index,
+                                const std::vector<unsigned int>& index_list,
+                                std::vector<float>& data) const
+{
+    data.clear();
+    if(tract_data[fiber_index].empty())
+        return;
+    unsigned int count = tract_data[fiber_index].size()/3;
+    unsigned int n = index_list.size();
+    data.resize(count*n);
+    // voxel-based indices in the diffusion space share the trilinear weights of each point
+    std::vector<const float*> images;
+    std::vector<unsigned int> images_pos;
+    for(unsigned int i = 0;i < n;++i)
+        if(index_list[i] >= fib->other_index.size() &&
+           handle->view_item[index_list[i]].image_data.geometry() == handle->dim)
+        {
+            images.push_back(&*handle->view_item[index_list[i]].image_data.begin());
+            images_pos.push_back(i);
+        }
+        else
+        {
+            std::vector<float> single;
+            get_tract_data(fiber_index,index_list[i],single);
+            for(unsigned int point_index = 0;point_index < count;++point_index)
+                data[point_index*n+i] = single[point_index];
+        }
+    if(images.empty())
+        return;
+    for(unsigned int point_index = 0;point_index < count;++point_index)
+    {
+        tipl::interpolation<tipl::linear_weighting,3> tri_interpo;
+        if(!tri_interpo.get_location(handle->dim,&(tract_data[fiber_index][point_index*3])))
+            continue;
+        float* out = &data[point_index*n];
+        for(unsigned int k = 0;k < images.size();++k)
+        {
+            const float* I = images[k];
+            float value = 0.0f;
+            for(unsigned int index = 0;index < 8;++index)
+                value += I[tri_interpo.dindex[index]]*tri_interpo.ratio[index];
+            out[images_pos[k]] = value;
+        }
+    }
+}
+
 bool TractModel::get_tracts_data(
         const std::string& index_name,
         std::vector<std::vector<float> >& data) const
@@ -1975,31 +2024,83 @@ bool TractModel::get_tracts_data(
         return false;
     data.clear();
     data.resize(tract_data.size());
-    for (unsigned int i = 0;i < tract_data.size();++i)
+    tipl::par_for(tract_data.size(),[&](unsigned int i)
+    {
         get_tract_data(i,index_num,data[i]);
+    });
     return true;
 }
-void TractModel::get_tracts_data(unsigned int data_index,float& mean, float& sd) const
+
+bool TractModel::get_tracts_mean(
+        const std::string& index_name,
+        std::vector<float>& mean) const
 {
-    float sum_data = 0.0;
-    float sum_data2 = 0.0;
-    unsigned int total = 0;
-    for (unsigned int i = 0;i < tract_data.size();++i)
+    unsigned int index_num = handle->get_name_index(index_name);
+    if(index_num == handle->view_item.size())
+        return false;
+    mean.clear();
+    mean.resize(tract_data.size());
+    tipl::par_for(tract_data.size(),[&](unsigned int i)
     {
         std::vector<float> data;
-        get_tract_data(i,data_index,data);
-        for(int j = 0;j < data.size();++j)
+        get_tract_data(i,index_num,data);
+        mean[i] = tipl::mean(data.begin(),data.end());
+    });
+    return true;
+}
+
+void TractModel::get_tracts_data(const std::vector<unsigned int>& index_list,
+                                 std::vector<float>& mean,std::vector<float>& sd) const
+{
+    unsigned int n = index_list.size();
+    // each thread block sums a contiguous range of tracts, and the blocks are added in order
+    size_t block_count = std::max<size_t>(1,std::min<size_t>(std::thread::hardware_concurrency(),tract_data.size()/64));
+    size_t block_size = (tract_data.size()+block_count-1)/block_count;
+    std::vector<std::vector<double> > block_sum(block_count),block_sum2(block_count);
+    std::vector<size_t> block_total(block_count);
+    tipl::par_for(block_count,[&](unsigned int block)
+    {
+        std::vector<double>& sum = block_sum[block];
+        std::vector<double>& sum2 = block_sum2[block];
+        sum.resize(n);
+        sum2.resize(n);
+        std::vector<float> data;
+        size_t to = std::min<size_t>(tract_data.size(),(block+1)*block_size);
+        for(size_t i = block*block_size;i < to;++i)
         {
-            float value = data[j];
-            sum_data += value;
-            sum_data2 += value*value;
-            ++total;
+            get_tract_data(i,index_list,data);
+            for(size_t j = 0;j < data.size();j += n)
+                for(unsigned int k = 0;k < n;++k)
+                {
+                    double value = data[j+k];
+                    sum[k] += value;
+                    sum2[k] += value*value;
+                }
+            block_total[block] += data.size()/std::max<unsigned int>(1,n);
         }
+    });
+    mean.resize(n);
+    sd.resize(n);
+    double total = std::accumulate(block_total.begin(),block_total.end(),size_t(0));
+    for(unsigned int k = 0;k < n;++k)
+    {
+        double sum = 0.0,sum2 = 0.0;
+        for(size_t block = 0;block < block_count;++block)
+        {
+            sum += block_sum[block][k];
+            sum2 += block_sum2[block][k];
+        }
+        mean[k] = sum/total;
+        sd[k] = std::sqrt(std::max<double>(0.0,sum2/total-mean[k]*double(mean[k])));
     }
+}
 
-    mean = sum_data/((double)total);
-    sd = std::sqrt(sum_data2/(double)total-sum_data*sum_data/(double)total/(double)total);
-
+void TractModel::get_tracts_data(unsigned int data_index,float& mean, float& sd) const
+{
+    std::vector<float> m,s;
+    get_tracts_data(std::vector<unsigned int>(1,data_index),m,s);
+    mean = m[0];
+    sd = s[0];
 }
 // return region overlapped ratio
 float create_region_map(const tipl::geometry<3>& geometry,
@@ -2044,10 +2145,10 @@ void TractModel::get_passing_list(const std::vector<std::vector<tipl::vector<3,s
     std::vector<std::vector<short> > region_map;
     overlap_ratio = create_region_map(geometry,regions,region_map);
 
-    for(unsigned int index = 0;index < tract_data.size();++index)
+    tipl::par_for(tract_data.size(),[&](unsigned int index)
     {
         if(tract_data[index].size() < 6)
-            continue;
+            return;
         std::vector<unsigned char> has_region(regions.size());
         unsigned int half_length = tract_data[index].size()/2;
         for(unsigned int ptr = 0;ptr < tract_data[index].size();ptr += 3)
@@ -2068,7 +2169,7 @@ void TractModel::get_passing_list(const std::vector<std::vector<tipl::vector<3,s
             if(has_region[i] == 2)
                 passing_list2[index].push_back(i);
         }
-    }
+    });
 }
 
 void TractModel::get_end_list(const std::vector<std::vector<tipl::vector<3,short> > >& regions,
@@ -2084,10 +2185,10 @@ void TractModel::get_end_list(const std::vector<std::vector<tipl::vector<3,short
     std::vector<std::vector<short> > region_map;
     overlap_ratio = create_region_map(geometry,regions,region_map);
 
-    for(unsigned int index = 0;index < tract_data.size();++index)
+    tipl::par_for(tract_data.size(),[&](unsigned int index)
     {
         if(tract_data[index].size() < 6)
-            continue;
+            return;
         tipl::pixel_index<3> end1(std::round(tract_data[index][0]),
                                     std::round(tract_data[index][1]),
                                     std::round(tract_data[index][2]),geometry);
@@ -2095,10 +2196,10 @@ void TractModel::get_end_list(const std::vector<std::vector<tipl::vector<3,short
                                     std::round(tract_data[index][tract_data[index].size()-2]),
                                     std::round(tract_data[index][tract_data[index].size()-1]),geometry);
         if(!geometry.is_valid(end1) || !geometry.is_valid(end2))
-            continue;
+            return;
         end_pair1[index] = region_map[end1.index()];
         end_pair2[index] = region_map[end2.index()];
-    }
+    });
 }
 
 
@@ -2131,12 +2232,10 @@ void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_cou
             std::fill(tract_cluster.begin(),tract_cluster.end(),80);
             if(!track_network.can_recognize())
                 return;
-            tipl::par_for(tract_data.size(),[&](int i)
+            unsigned int output_size = track_network.cnn.get_output_size();
+            track_network.predict(handle.get(),tract_data,[&](size_t i,const float* output)
             {
-                std::vector<float> input;
-                if(!handle->get_profile(tract_data[i],input))
-                    return;
-                tract_cluster[i] = track_network.cnn.predict_label(input);
+                tract_cluster[i] = std::max_element(output,output+output_size)-output;
             });
         }
         return;
@@ -2229,17 +2328,30 @@ void ConnectivityMatrix::set_atlas(atlas& data,const tipl::image<tipl::vector<3,
         return;
     tipl::geometry<3> geo(mni_position.geometry());
     tipl::vector<3> null;
+    region_name = data.get_list();
+    unsigned int label_count = region_name.size();
+    // one pass over the voxels for all labels. Slices are labeled in parallel and
+    // concatenated in order, so the voxel order of each region is unchanged.
+    std::vector<std::vector<std::vector<tipl::vector<3,short> > > > slice_regions(geo.depth());
+    tipl::par_for(geo.depth(),[&](unsigned int z)
+    {
+        std::vector<unsigned int> label_index;
+        slice_regions[z].resize(label_count);
+        for(tipl::pixel_index<3> index(z*geo.plane_size(),geo);index.index() < (z+1)*geo.plane_size();++index)
+        {
+            if(mni_position[index.index()] == null)
+                continue;
+            data.get_label_index_at(mni_position[index.index()],label_index);
+            for(unsigned int i = 0;i < label_index.size();++i)
+                if(label_index[i] < label_count)
+                    slice_regions[z][label_index[i]].push_back(tipl::vector<3,short>(index.begin()));
+        }
+    });
     regions.clear();
-    region_name.clear();
-    for (unsigned int label_index = 0; label_index < data.get_list().size(); ++label_index)
-    {
-        std::vector<tipl::vector<3,short> > cur_region;
-        for (tipl::pixel_index<3> index(geo); index < geo.size();++index)
-            if(mni_position[index.index()] != null && data.is_labeled_as(mni_position[index.index()],label_index))
-                cur_region.push_back(tipl::vector<3,short>(index.begin()));
-        regions.push_back(cur_region);
-        region_name.push_back(data.get_list()[label_index]);
-    }
+    regions.resize(label_count);
+    for(unsigned int z = 0;z < slice_regions.size();++z)
+        for(unsigned int i = 0;i < label_count;++i)
+            regions[i].insert(regions[i].end(),slice_regions[z][i].begin(),slice_regions[z][i].end());
 }
 
 
@@ -2270,6 +2382,51 @@ void for_each_connectivity(const T& end_list1,
     }
 }
 
+// accumulates lambda_fun(value,index) of every connected region pair into a flat row-major n-by-n matrix.
+// The tracts are split into contiguous blocks, one per thread, and each block has its own matrix.
+// The block matrices are summed in block order, so the result does not depend on the thread timing.
+template<class value_type,class T,class fun_type>
+void accumulate_connectivity(const T& end_list1,
+                             const T& end_list2,
+                             unsigned int n,
+                             std::vector<value_type>& result,
+                             fun_type lambda_fun)
+{
+    size_t matrix_size = size_t(n)*size_t(n);
+    // keep the block matrices within 1GB
+    size_t block_count = std::max<size_t>(1,std::min<size_t>(std::thread::hardware_concurrency(),
+                                          (size_t(1) << 30)/(matrix_size*sizeof(value_type)+1)));
+    block_count = std::max<size_t>(1,std::min<size_t>(block_count,end_list1.size()/1024));
+    size_t block_size = (end_list1.size()+block_count-1)/block_count;
+    std::vector<std::vector<value_type> > block_result(block_count);
+    tipl::par_for(block_count,[&](unsigned int block)
+    {
+        std::vector<value_type>& m = block_result[block];
+        m.resize(matrix_size);
+        size_t to = std::min<size_t>(end_list1.size(),(block+1)*block_size);
+        for(size_t index = block*block_size;index < to;++index)
+        {
+            const auto& r1 = end_list1[index];
+            const auto& r2 = end_list2[index];
+            for(unsigned int i = 0;i < r1.size();++i)
+                for(unsigned int j = 0;j < r2.size();++j)
+                    if(r1[i] != r2[j])
+                    {
+                        lambda_fun(m[size_t(r1[i])*n+size_t(r2[j])],index);
+                        lambda_fun(m[size_t(r2[j])*n+size_t(r1[i])],index);
+                    }
+        }
+    });
+    result.swap(block_result[0]);
+    tipl::par_for(n,[&](unsigned int i)
+    {
+        size_t from = size_t(i)*n,to = from+n;
+        for(size_t block = 1;block < block_result.size();++block)
+            for(size_t pos = from;pos < to;++pos)
+                result[pos] += block_result[block][pos];
+    });
+}
+
 bool ConnectivityMatrix::calculate(TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold)
 {
     if(regions.size() == 0)
@@ -2309,132 +2466,131 @@ bool ConnectivityMatrix::calculate(TractModel& tract_model,std::string matrix_va
             }
         return true;
     }
+    unsigned int n = regions.size();
     matrix_value.clear();
-    matrix_value.resize(tipl::geometry<2>(regions.size(),regions.size()));
-    std::vector<std::vector<unsigned int> > count;
-    init_matrix(count,regions.size());
-
-    for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int,short i,short j){
-        ++count[i][j];
-    });
+    matrix_value.resize(tipl::geometry<2>(n,n));
+    // count, sum_length, and sum are flat row-major n-by-n matrices
+    std::vector<unsigned int> count;
+    accumulate_connectivity(end_list1,end_list2,n,count,
+                            [&](unsigned int& value,size_t){++value;});
 
     // determine the threshold for counting the connectivity
-    unsigned int threshold_count = 0;
-    for(unsigned int i = 0,index = 0;i < count.size();++i)
-        for(unsigned int j = 0;j < count[i].size();++j,++index)
-            threshold_count = std::max<unsigned int>(threshold_count,count[i][j]);
+    unsigned int threshold_count = *std::max_element(count.begin(),count.end());
     threshold_count *= threshold;
 
     if(matrix_value_type == "count")
     {
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                matrix_value[index] = (count[i][j] > threshold_count ? count[i][j] : 0);
+        for(size_t index = 0;index < count.size();++index)
+            matrix_value[index] = (count[index] > threshold_count ? count[index] : 0);
         return true;
     }
     if(matrix_value_type == "ncount" || matrix_value_type == "ncount2")
     {
-        std::vector<std::vector<std::vector<unsigned int> > > length_matrix;
-        init_matrix(length_matrix,regions.size());
-
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,short i,short j){
-            length_matrix[i][j].push_back(tract_model.get_tract_length(index));
-        });
-
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                if(!length_matrix[i][j].empty() && count[i][j] >= threshold_count)
+        // lengths of each region pair are stored contiguously from length_offset[index]
+        std::vector<size_t> length_offset(count.size()+1);
+        for(size_t index = 0;index < count.size();++index)
+            length_offset[index+1] = length_offset[index] + count[index];
+        std::vector<unsigned int> length_list(length_offset.back());
+        {
+            std::vector<size_t> pos(length_offset.begin(),length_offset.end()-1);
+            for_each_connectivity(end_list1,end_list2,
+                                  [&](unsigned int index,short i,short j){
+                length_list[pos[size_t(i)*n+size_t(j)]++] = tract_model.get_tract_length(index);
+            });
+        }
+        tipl::par_for(n,[&](unsigned int i)
+        {
+            for(size_t index = size_t(i)*n,to = index+n;index < to;++index)
+                if(count[index] && count[index] >= threshold_count)
                 {
+                    auto beg = length_list.begin()+length_offset[index];
+                    auto end = length_list.begin()+length_offset[index+1];
                     float length = 0.0;
                     if(matrix_value_type == "ncount")
-                        length = 1.0f/tipl::median(length_matrix[i][j].begin(),length_matrix[i][j].end());
+                        length = 1.0f/tipl::median(beg,end);
                     else
                     {
-                        for(int k = 0;k < length_matrix[i][j].size();++k)
-                            length += 1.0/length_matrix[i][j][k];
+                        for(;beg != end;++beg)
+                            length += 1.0/(*beg);
                     }
-                    matrix_value[index] = count[i][j]*length;
+                    matrix_value[index] = count[index]*length;
                 }
                 else
                     matrix_value[index] = 0;
-
+        });
         return true;
     }
 
 
     if(matrix_value_type == "mean_length")
     {
-        std::vector<std::vector<unsigned int> > sum_length,sum_n;
-        init_matrix(sum_length,regions.size());
-        init_matrix(sum_n,regions.size());
-
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,short i,short j){
-            sum_length[i][j] += tract_model.get_tract_length(index);
-            ++sum_n[i][j];
+        std::vector<unsigned int> sum_length;
+        accumulate_connectivity(end_list1,end_list2,n,sum_length,
+                                [&](unsigned int& value,size_t index){
+            value += tract_model.get_tract_length(index);
         });
-
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                if(sum_n[i][j] && count[i][j] > threshold_count)
-                    matrix_value[index] = (float)sum_length[i][j]/(float)sum_n[i][j]/3.0;
+        for(size_t index = 0;index < count.size();++index)
+            if(count[index] && count[index] > threshold_count)
+                matrix_value[index] = (float)sum_length[index]/(float)count[index]/3.0;
         return true;
     }
-    std::vector<std::vector<float> > data;
-    if(!tract_model.get_tracts_data(matrix_value_type,data))
+    std::vector<float> m;
+    if(!tract_model.get_tracts_mean(matrix_value_type,m))
     {
         error_msg = "Cannot quantify matrix value using ";
         error_msg += matrix_value_type;
         return false;
     }
-    std::vector<std::vector<float> > sum;
-    init_matrix(sum,regions.size());
-
-    std::vector<float> m(data.size());
-    for(unsigned int index = 0;index < data.size();++index)
-        m[index] = tipl::mean(data[index].begin(),data[index].end());
-
-    for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int index,short i,short j){
-        sum[i][j] += m[index];
+    std::vector<double> sum;
+    accumulate_connectivity(end_list1,end_list2,n,sum,
+                            [&](double& value,size_t index){
+        value += m[index];
     });
-
-
-    for(unsigned int i = 0,index = 0;i < count.size();++i)
-        for(unsigned int j = 0;j < count[i].size();++j,++index)
-            matrix_value[index] = (count[i][j] > threshold_count ? sum[i][j]/(float)count[i][j] : 0);
+    for(size_t index = 0;index < count.size();++index)
+        matrix_value[index] = (count[index] > threshold_count ? sum[index]/(float)count[index] : 0);
     return true;
 
 }
+// D[i][j] is the length of the shortest walk (at least one edge) from i to j, so that
+// the diagonal keeps the shortest cycle length. Each source is a breadth-first search.
 template<class matrix_type>
-void distance_bin(const matrix_type& bin,tipl::image<float,2>& D)
+void distance_bin(const matrix_type& bin,tipl::image<float,2>& D,bool parallel = true)
 {
     unsigned int n = bin.width();
-    tipl::image<unsigned int,2> A,Lpath;
-    A = bin;
-    Lpath = bin;
-    D = bin;
-    for(unsigned int l = 2;1;++l)
-    {
-        tipl::image<unsigned int,2> t(A.geometry());
-        tipl::mat::product(Lpath.begin(),A.begin(),t.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        std::swap(Lpath,t);
-        bool con = false;
-        for(unsigned int i = 0;i < D.size();++i)
-            if(Lpath[i] != 0 && D[i] == 0)
+    D.clear();
+    D.resize(bin.geometry());
+    auto search = [&](unsigned int i)
+    {
+        float* Di = &D[i*n];
+        std::vector<unsigned int> front,next;
+        for(unsigned int k = 0,pos = i*n;k < n;++k,++pos)
+            if(bin[pos] != 0)
             {
-                D[i] = l;
-                con = true;
+                Di[k] = 1;
+                front.push_back(k);
             }
-        if(!con)
-            break;
-    }
+        for(unsigned int l = 2;!front.empty();++l)
+        {
+            next.clear();
+            for(unsigned int j = 0;j < front.size();++j)
+                for(unsigned int k = 0,pos = front[j]*n;k < n;++k,++pos)
+                    if(bin[pos] != 0 && Di[k] == 0)
+                    {
+                        Di[k] = l;
+                        next.push_back(k);
+                    }
+            front.swap(next);
+        }
+    };
+    if(parallel)
+        tipl::par_for(n,search);
+    else
+        for(unsigned int i = 0;i < n;++i)
+            search(i);
     std::replace(D.begin(),D.end(),(float)0,std::numeric_limits<float>::max());
 }
 template<class matrix_type>
-void distance_wei(const matrix_type& W_,tipl::image<float,2>& D)
+void distance_wei(const matrix_type& W_,tipl::image<float,2>& D,bool parallel = true)
 {
     tipl::image<float,2> W(W_);
     for(unsigned int i = 0;i < W.size();++i)
@@ -2445,28 +2601,25 @@ void distance_wei(const matrix_type& W_,tipl::image<float,2>& D)
     std::fill(D.begin(),D.end(),std::numeric_limits<float>::max());
     for(unsigned int i = 0,dg = 0;i < n;++i,dg += n + 1)
         D[dg] = 0;
-    for(unsigned int i = 0,in = 0;i < n;++i,in += n)
+    // each source only writes its own row. Visited nodes are skipped instead of
+    // clearing their columns in a copy of W
+    auto search = [&](unsigned int i)
     {
+        unsigned int in = i*n;
         std::vector<unsigned char> S(n);
-        tipl::image<float,2> W1(W);
-
         std::vector<unsigned int> V;
         V.push_back(i);
         while(1)
         {
             for(unsigned int j = 0;j < V.size();++j)
-            {
                 S[V[j]] = 1;
-                for(unsigned int k = V[j];k < W1.size();k += n)
-                    W1[k] = 0;
-            }
             for(unsigned int j = 0;j < V.size();++j)
             {
                 unsigned int v = V[j];
                 unsigned int vn = v*n;
                 for(unsigned int k = 0;k < n;++k)
-                if(W1[vn+k] > 0)
-                    D[in+k] = std::min<float>(D[in+k],D[in+v]+W1[vn+k]);
+                if(!S[k] && W[vn+k] > 0)
+                    D[in+k] = std::min<float>(D[in+k],D[in+v]+W[vn+k]);
             }
             float minD = std::numeric_limits<float>::max();
             for(unsigned int j = 0;j < n;++j)
@@ -2479,7 +2632,12 @@ void distance_wei(const matrix_type& W_,tipl::image<float,2>& D)
                 if(D[in+j]  == minD)
                     V.push_back(j);
         }
-    }
+    };
+    if(parallel)
+        tipl::par_for(n,search);
+    else
+        for(unsigned int i = 0;i < n;++i)
+            search(i);
     std::replace(D.begin(),D.end(),(float)0.0,std::numeric_limits<float>::max());
 }
 template<class matrix_type>
@@ -2530,16 +2688,18 @@ void ConnectivityMatrix::network_property(std::string& report)
         strength[i] = std::accumulate(norm_matrix.begin()+i*n,norm_matrix.begin()+(i+1)*n,0.0);
     // calculate clustering coefficient
     std::vector<float> cluster_co(n);
-    for(unsigned int i = 0,posi = 0;i < n;++i,posi += n)
-    if(degree[i] >= 2)
+    tipl::par_for(n,[&](unsigned int i)
     {
+        unsigned int posi = i*n;
+        if(degree[i] < 2)
+            return;
         for(unsigned int j = 0,index = 0;j < n;++j)
             for(unsigned int k = 0;k < n;++k,++index)
                 if(binary_matrix[posi + j] && binary_matrix[posi + k])
                     cluster_co[i] += binary_matrix[index];
         float d = degree[i];
         cluster_co[i] /= (d*d-d);
-    }
+    });
     float cc_bin = tipl::mean(cluster_co.begin(),cluster_co.end());
     out << "clustering_coeff_average(binary)\t" << cc_bin << std::endl;
 
@@ -2626,12 +2786,13 @@ void ConnectivityMatrix::network_property(std::string& report)
     std::vector<float> local_efficiency_bin(n);
     //claculate local efficiency
     {
-        for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
+        tipl::par_for(n,[&](unsigned int i)
         {
+            unsigned int ipos = i*n;
             unsigned int new_n = std::accumulate(binary_matrix.begin()+ipos,
                                                  binary_matrix.begin()+ipos+n,0);
             if(new_n < 2)
-                continue;
+                return;
             tipl::image<float,2> newA(tipl::geometry<2>(new_n,new_n));
             unsigned int pos = 0;
             for(unsigned int j = 0,index = 0;j < n;++j)
@@ -2643,10 +2804,10 @@ void ConnectivityMatrix::network_property(std::string& report)
                         ++pos;
                     }
             tipl::image<float,2> invD;
-            distance_bin(newA,invD);
+            distance_bin(newA,invD,false);
             inv_dis(invD,invD);
             local_efficiency_bin[i] = std::accumulate(invD.begin(),invD.end(),0.0)/(new_n*new_n-new_n);
-        }
+        });
         out << "local_efficiency(binary)\t" << std::accumulate(local_efficiency_bin.begin(),local_efficiency_bin.end(),0.0) << std::endl;
 
     }
@@ -2654,12 +2815,13 @@ void ConnectivityMatrix::network_property(std::string& report)
     std::vector<float> local_efficiency_wei(n);
     {
 
-        for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
+        tipl::par_for(n,[&](unsigned int i)
         {
+            unsigned int ipos = i*n;
             unsigned int new_n = std::accumulate(binary_matrix.begin()+ipos,
                                                  binary_matrix.begin()+ipos+n,0);
             if(new_n < 2)
-                continue;
+                return;
             tipl::image<float,2> newA(tipl::geometry<2>(new_n,new_n));
             unsigned int pos = 0;
             for(unsigned int j = 0,index = 0;j < n;++j)
@@ -2675,14 +2837,14 @@ void ConnectivityMatrix::network_property(std::string& report)
                 if(binary_matrix[ipos+j])
                     sw.push_back(std::pow(norm_matrix[ipos+j],(float)(1.0/3.0)));
             tipl::image<float,2> invD;
-            distance_wei(newA,invD);
+            distance_wei(newA,invD,false);
             inv_dis(invD,invD);
             float numer = 0.0;
             for(unsigned int j = 0,index = 0;j < new_n;++j)
                 for(unsigned int k = 0;k < new_n;++k,++index)
                     numer += std::pow(invD[index],(float)(1.0/3.0))*sw[j]*sw[k];
             local_efficiency_wei[i] = numer/(new_n*new_n-new_n);
-        }
+        });
         out << "local_efficiency(weighted)\t" << std::accumulate(local_efficiency_wei.begin(),local_efficiency_wei.end(),0.0) << std::endl;
 
     }
@@ -128,9 +128,18 @@ public:
         void get_tract_data(unsigned int fiber_index,
                             unsigned int index_num,
                             std::vector<float>& data) const;
+        // samples all indices of index_list at each point: data[point*index_list.size()+i]
+        void get_tract_data(unsigned int fiber_index,
+                            const std::vector<unsigned int>& index_list,
+                            std::vector<float>& data) const;
         bool get_tracts_data(
                 const std::string& index_name,
                 std::vector<std::vector<float> >& data) const;
+        bool get_tracts_mean(
+                const std::string& index_name,
+                std::vector<float>& mean) const;
+        void get_tracts_data(const std::vector<unsigned int>& index_list,
+                             std::vector<float>& mean,std::vector<float>& sd) const;
         void get_tracts_data(unsigned int index_num,float& mean, float& sd) const;
 public:
 
@@ -2,18 +2,89 @@
 #include <QApplication>
 #include <QObject>
 #include <memory>
+#include <mutex>
+#include <algorithm>
 #include <ctime>
 #include <iostream>
 #include <QTime>
+#include "prog_interface_static_link.h"
 
 std::auto_ptr<QProgressDialog> progressDialog;
 QTime t_total,t_last;
 bool lock_dialog = false;
 bool prog_aborted_ = false;
 bool silence = false;
+thread_local prog_context* cur_prog = 0;
+
+// guards the parent and children links of all contexts
+std::mutex prog_tree_lock;
+prog_context::prog_context(prog_context* parent_):parent(parent_),aborted_(false),now_(0),total_(0)
+{
+    if(parent)
+    {
+        std::lock_guard<std::mutex> guard(prog_tree_lock);
+        parent->children.push_back(this);
+        aborted_ = parent->aborted();
+    }
+}
+prog_context::~prog_context(void)
+{
+    std::lock_guard<std::mutex> guard(prog_tree_lock);
+    if(parent)
+        parent->children.erase(std::remove(parent->children.begin(),parent->children.end(),this),
+                               parent->children.end());
+    for(unsigned int i = 0;i < children.size();++i)
+        children[i]->parent = 0;
+}
+void prog_context::abort_tree(void)
+{
+    aborted_ = true;
+    for(unsigned int i = 0;i < children.size();++i)
+        children[i]->abort_tree();
+}
+void prog_context::abort(void)
+{
+    std::lock_guard<std::mutex> guard(prog_tree_lock);
+    abort_tree();
+}
+float prog_context::progress_tree(void) const
+{
+    if(children.empty())
+    {
+        unsigned int total = total_.load(std::memory_order_relaxed);
+        return total ? std::min<float>(1.0f,float(now_.load(std::memory_order_relaxed))/float(total)):0.0f;
+    }
+    float sum = 0.0f;
+    for(unsigned int i = 0;i < children.size();++i)
+        sum += children[i]->progress_tree();
+    return sum/float(children.size());
+}
+float prog_context::progress(void) const
+{
+    std::lock_guard<std::mutex> guard(prog_tree_lock);
+    return progress_tree();
+}
+prog_scope::prog_scope(prog_context* context):prev(cur_prog)
+{
+    if(context)
+        cur_prog = context;
+}
+prog_scope::~prog_scope(void)
+{
+    cur_prog = prev;
+}
+prog_context* current_prog(void)
+{
+    return cur_prog;
+}
 
 void begin_prog(const char* title,bool lock)
 {
+    if(cur_prog)
+    {
+        cur_prog->check(0,0);
+        return;
+    }
     if(!progressDialog.get())
     {
         std::cout << title << std::endl;
@@ -35,6 +106,8 @@ void unique_prog(bool unique)
 
 bool is_running(void)
 {
+    if(cur_prog)
+        return !cur_prog->aborted();
     if(!progressDialog.get())
         return false;
     return progressDialog->isVisible();
@@ -42,6 +115,8 @@ bool is_running(void)
 
 void set_title(const char* title)
 {
+    if(cur_prog)
+        return;
     if(!progressDialog.get())
     {
         std::cout << title << std::endl;
@@ -52,6 +127,8 @@ void set_title(const char* title)
 }
 bool check_prog(unsigned int now,unsigned int total)
 {
+    if(cur_prog)
+        return cur_prog->check(now,total);
     if(silence)
         return now < total;
     if(now >= total && progressDialog.get() && !lock_dialog)
@@ -89,6 +166,8 @@ bool check_prog(unsigned int now,unsigned int total)
 
 bool prog_aborted(void)
 {
+    if(cur_prog)
+        return cur_prog->aborted();
     if(prog_aborted_)
         return true;
     if(progressDialog.get())
@@ -1,5 +1,8 @@
 #include <cstdlib>     /* srand, rand */
 #include <ctime>
+#include <cstdio>
+#include <thread>
+#include <QFileInfo>
 #include "vbc_database.h"
 #include "fib_data.hpp"
 #include "libs/tracking/tract_model.hpp"
@@ -105,76 +108,253 @@ void cal_hist(const std::vector<std::vector<float> >& track,std::vector<unsigned
     }
 }
 
+// tracking-free estimate of the length histogram. Each suprathreshold fiber is a node
+// linked to the best aligned fiber in the voxels one step forward and backward along it.
+// A track seeded at a voxel is assumed to run through the whole connected component of
+// its main fiber, and the seeds are weighted to the same track count as run_track.
+// Like run_track, it runs in the calling thread unless thread_count is larger than 1,
+// because the permutation workers already occupy all cores.
+int vbc_database::run_graph(const tracking_data& fib,std::vector<unsigned int>& hist,float seed_ratio,unsigned int thread_count)
+{
+    const tipl::geometry<3>& dim = fib.dim;
+    unsigned int fib_num = fib.fib_num;
+    size_t node_count = dim.size()*fib_num;
+    std::vector<unsigned int> link(node_count*2,0xFFFFFFFF);
+    auto link_voxel = [&](unsigned int index)
+    {
+        tipl::pixel_index<3> pos(index,dim);
+        for(unsigned char f = 0;f < fib_num && fib.fa[f][index] > tracking_threshold;++f)
+        {
+            tipl::vector<3> dir(fib.get_dir(index,f));
+            for(int side = 0;side < 2;++side)
+            {
+                float sign = side ? -1.0f : 1.0f;
+                int x = std::round(pos[0]+sign*dir[0]);
+                int y = std::round(pos[1]+sign*dir[1]);
+                int z = std::round(pos[2]+sign*dir[2]);
+                if(x < 0 || y < 0 || z < 0 || x >= dim[0] || y >= dim[1] || z >= dim[2])
+                    continue;
+                unsigned int next_index = tipl::pixel_index<3>(x,y,z,dim).index();
+                unsigned char fib_order,reverse;
+                // cos(52.5 degrees), the median of the 15~90 degree random angular thresholds of run_track
+                if(next_index != index &&
+                   fib.get_nearest_dir_fib(next_index,dir,fib_order,reverse,tracking_threshold,0.6f))
+                    link[(index*fib_num+f)*2+side] = next_index*fib_num+fib_order;
+            }
+        }
+    };
+    if(thread_count > 1)
+        tipl::par_for(dim.size(),link_voxel);
+    else
+        for(unsigned int index = 0;index < dim.size();++index)
+            link_voxel(index);
+    std::vector<unsigned int> root(node_count);
+    for(unsigned int i = 0;i < root.size();++i)
+        root[i] = i;
+    auto find_root = [&](unsigned int i) -> unsigned int
+    {
+        while(root[i] != i)
+            i = root[i] = root[root[i]];
+        return i;
+    };
+    for(unsigned int i = 0;i < link.size();++i)
+        if(link[i] != 0xFFFFFFFF)
+        {
+            unsigned int r1 = find_root(i >> 1),r2 = find_root(link[i]);
+            if(r1 != r2)
+                root[std::max(r1,r2)] = std::min(r1,r2);
+        }
+    std::vector<unsigned int> component_size(node_count);
+    std::vector<unsigned int> seed;
+    for(unsigned int index = 0;index < dim.size();++index)
+        for(unsigned char f = 0;f < fib_num && fib.fa[f][index] > tracking_threshold;++f)
+        {
+            ++component_size[find_root(index*fib_num+f)];
+            if(f == 0)
+                seed.push_back(index);
+        }
+    unsigned int count = seed.size()*seed_ratio*10000.0f/(float)voxels_in_threshold;
+    if(!count || hist.empty())
+        return 0;
+    std::vector<double> weight(hist.size());
+    for(unsigned int i = 0;i < seed.size();++i)
+    {
+        // the track length is the number of steps, one less than the voxels passed
+        unsigned int length = component_size[find_root(seed[i]*fib_num)]-1;
+        if(!length)
+            continue;
+        weight[std::min<size_t>(length,hist.size()-1)] += 1.0;
+    }
+    for(unsigned int i = 0;i < hist.size();++i)
+        hist[i] += std::round(weight[i]*count/seed.size());
+    return count;
+}
+
+// the length histogram of the current spm map. Tracks are still generated in the fast
+// null mode when they are kept for the output. The graph does not model regions or
+// track trimming, so tracking is used whenever either is set.
+int vbc_database::get_length_hist(const tracking_data& fib,std::vector<std::vector<float> >& tracks,
+                                  std::vector<unsigned int>& hist,bool keep_tracks)
+{
+    if(!fast_null || !roi_list.empty() || track_trimming)
+    {
+        int s = run_track(fib,tracks,seed_ratio);
+        cal_hist(tracks,hist);
+        return s;
+    }
+    tracks.clear();
+    if(keep_tracks)
+        run_track(fib,tracks,seed_ratio);
+    return run_graph(fib,hist,seed_ratio);
+}
+
+// histograms and seed counts of one permutation
+struct permutation_result{
+    std::vector<unsigned int> greater_null,lesser_null,greater,lesser;
+    unsigned int seed_greater_null = 0,seed_lesser_null = 0,seed_greater = 0,seed_lesser = 0;
+    permutation_result(void):greater_null(200),lesser_null(200),greater(200),lesser(200){}
+};
+
 void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thread_count,unsigned int permutation_count)
 {
     connectometry_result data;
     tracking_data fib;
     fib.read(*handle);
     std::vector<std::vector<float> > tracks;
+    std::vector<float> random_subject_qa;
 
-    if(model->type == 2) // individual
+    // the random numbers of a permutation are seeded by its index, so that the result
+    // does not depend on the thread that runs it or on whether the run was resumed
+    for(unsigned int job;(job = next_permutation++) < pending_permutation.size() && !terminated;)
     {
+        unsigned int i = pending_permutation[job];
+        permutation_result result;
+        for(unsigned int pass = 0;pass < 2 && !terminated;++pass)
+        {
+            bool null = (pass == 0);
+            std::mt19937 gen(i*2+pass);
+            if(model->type == 2) // individual
+            {
+                for(unsigned int subject_id = 0;subject_id < individual_data.size() && !terminated;++subject_id)
+                {
+                    stat_model info;
+                    info.resample(*model.get(),null,true,gen);
+                    if(null)
+                    {
+                        unsigned int random_subject_id = std::uniform_int_distribution<int>(0,model->subject_index.size()-1)(gen);
+                        if(handle->db.is_mapped())
+                        {
+                            handle->db.get_subject_qa(random_subject_id,random_subject_qa);
+                            info.individual_data = &random_subject_qa[0];
+                        }
+                        else
+                            info.individual_data = handle->db.subject_qa[random_subject_id];
+                        info.individual_data_sd = normalize_qa ? handle->db.subject_qa_sd[random_subject_id]:1.0;
+                    }
+                    else
+                    {
+                        info.individual_data = &(individual_data[subject_id][0]);
+                        info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
+                    }
+                    calculate_spm(data,info,normalize_qa);
+                    fib.fa = data.lesser_ptr;
+                    get_length_hist(fib,tracks,(null) ? result.lesser_null : result.lesser,output_resampling && !null);
 
+                    if(output_resampling && !null)
+                    {
+                        std::lock_guard<std::mutex> lock(lock_lesser_tracks);
+                        lesser_tracks[subject_id]->add_tracts(tracks,length_threshold);
+                        tracks.clear();
+                    }
 
-        bool null = true;
-        for(int i = id;i < permutation_count && !terminated;)
-        {
 
-            for(unsigned int subject_id = 0;subject_id < individual_data.size() && !terminated;++subject_id)
+                    fib.fa = data.greater_ptr;
+                    get_length_hist(fib,tracks,(null) ? result.greater_null : result.greater,output_resampling && !null);
+
+                    if(output_resampling && !null)
+                    {
+                        std::lock_guard<std::mutex> lock(lock_greater_tracks);
+                        greater_tracks[subject_id]->add_tracts(tracks,length_threshold);
+                        tracks.clear();
+                    }
+
+                }
+            }
+            else
             {
                 stat_model info;
-                info.resample(*model.get(),null,true);
-                if(null)
-                {
-                    unsigned int random_subject_id = model->rand_gen(model->subject_index.size());
-                    info.individual_data = handle->db.subject_qa[random_subject_id];
-                    info.individual_data_sd = normalize_qa ? handle->db.subject_qa_sd[random_subject_id]:1.0;
-                }
-                else
-                {
-                    info.individual_data = &(individual_data[subject_id][0]);
-                    info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
-                }
+                info.resample(*model.get(),null,true,gen);
                 calculate_spm(data,info,normalize_qa);
+
                 fib.fa = data.lesser_ptr;
-                run_track(fib,tracks,seed_ratio);
-                cal_hist(tracks,(null) ? subject_lesser_null : subject_lesser);
+                unsigned int s = get_length_hist(fib,tracks,(null) ? result.lesser_null : result.lesser,output_resampling && !null);
+                if(null)
+                    result.seed_lesser_null = s;
+                else
+                    result.seed_lesser = s;
 
                 if(output_resampling && !null)
                 {
                     std::lock_guard<std::mutex> lock(lock_lesser_tracks);
-                    lesser_tracks[subject_id]->add_tracts(tracks,length_threshold);
+                    lesser_tracks[0]->add_tracts(tracks,length_threshold);
                     tracks.clear();
                 }
 
-
+                info.resample(*model.get(),null,true,gen);
+                calculate_spm(data,info,normalize_qa);
                 fib.fa = data.greater_ptr;
-                run_track(fib,tracks,seed_ratio);
-                cal_hist(tracks,(null) ? subject_greater_null : subject_greater);
+                s = get_length_hist(fib,tracks,(null) ? result.greater_null : result.greater,output_resampling && !null);
+                if(null)
+                    result.seed_greater_null = s;
+                else
+                    result.seed_greater = s;
 
                 if(output_resampling && !null)
                 {
                     std::lock_guard<std::mutex> lock(lock_greater_tracks);
-                    greater_tracks[subject_id]->add_tracts(tracks,length_threshold);
+                    greater_tracks[0]->add_tracts(tracks,length_threshold);
                     tracks.clear();
                 }
-
             }
-            if(!null)
-            {
-                i += thread_count;
-                if(id == 0)
-                    progress = i*100/permutation_count;
-            }
-            null = !null;
+        }
+        // an interrupted permutation is discarded and run again after resuming
+        if(terminated)
+            break;
+        {
+            std::lock_guard<std::mutex> lock(lock_permutation);
+            tipl::add(subject_greater_null,result.greater_null);
+            tipl::add(subject_lesser_null,result.lesser_null);
+            tipl::add(subject_greater,result.greater);
+            tipl::add(subject_lesser,result.lesser);
+            seed_greater_null[i] = result.seed_greater_null;
+            seed_lesser_null[i] = result.seed_lesser_null;
+            seed_greater[i] = result.seed_greater;
+            seed_lesser[i] = result.seed_lesser;
+            permutation_done[i] = 1;
+            ++finished_permutation;
+            if(!checkpoint_file.empty() &&
+               std::chrono::steady_clock::now()-last_checkpoint > std::chrono::seconds(checkpoint_interval))
+                save_checkpoint();
         }
         if(id == 0)
-        for(unsigned int subject_id = 0;subject_id < individual_data.size() && !terminated;++subject_id)
+            progress = finished_permutation*100/permutation_count;
+    }
+    if(!checkpoint_file.empty())
+    {
+        std::lock_guard<std::mutex> lock(lock_permutation);
+        save_checkpoint();
+    }
+    if(id == 0 && !terminated)
+    {
+        for(unsigned int subject_id = 0;subject_id < spm_maps.size() && !terminated;++subject_id)
         {
             stat_model info;
             info.resample(*model.get(),false,false);
-            info.individual_data = &(individual_data[subject_id][0]);
-            info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
+            if(model->type == 2) // individual
+            {
+                info.individual_data = &(individual_data[subject_id][0]);
+                info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
+            }
             calculate_spm(*spm_maps[subject_id],info,normalize_qa);
             if(terminated)
                 return;
@@ -188,90 +368,25 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
                 greater_tracks[subject_id]->add_tracts(tracks,length_threshold);
             }
         }
+        // wait for the permutations still running in other threads
+        while(finished_permutation < permutation_count && !terminated)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if(!terminated)
+            progress = 100;
     }
-    else
-    {
-
-        bool null = true;
-        for(int i = id;i < permutation_count && !terminated;)
-        {
-
-            stat_model info;
-            info.resample(*model.get(),null,true);
-            calculate_spm(data,info,normalize_qa);
-
-            fib.fa = data.lesser_ptr;
-            unsigned int s = run_track(fib,tracks,seed_ratio);
-            if(null)
-                seed_lesser_null[i] = s;
-            else
-                seed_lesser[i] = s;
-
-            cal_hist(tracks,(null) ? subject_lesser_null : subject_lesser);
-
-            if(output_resampling && !null)
-            {
-                std::lock_guard<std::mutex> lock(lock_lesser_tracks);
-                lesser_tracks[0]->add_tracts(tracks,length_threshold);
-                tracks.clear();
-            }
-
-            info.resample(*model.get(),null,true);
-            calculate_spm(data,info,normalize_qa);
-            fib.fa = data.greater_ptr;
-            s = run_track(fib,tracks,seed_ratio);
-            if(null)
-                seed_greater_null[i] = s;
-            else
-                seed_greater[i] = s;
-            cal_hist(tracks,(null) ? subject_greater_null : subject_greater);
-
-            if(output_resampling && !null)
-            {
-                std::lock_guard<std::mutex> lock(lock_greater_tracks);
-                greater_tracks[0]->add_tracts(tracks,length_threshold);
-                tracks.clear();
-            }
-
-            if(!null)
-            {
-                i += thread_count;
-                if(id == 0)
-                    progress = i*100/permutation_count;
-            }
-            null = !null;
-        }
-        if(id == 0)
-        {
-            stat_model info;
-            info.resample(*model.get(),false,false);
-            calculate_spm(*spm_maps[0],info,normalize_qa);
-
-            if(terminated)
-                return;
-            if(!output_resampling)
-            {
-                fib.fa = spm_maps[0]->lesser_ptr;
-                run_track(fib,tracks,seed_ratio*permutation_count,threads.size());
-                lesser_tracks[0]->add_tracts(tracks,length_threshold);
-                fib.fa = spm_maps[0]->greater_ptr;
-                run_track(fib,tracks,seed_ratio*permutation_count,threads.size());
-                greater_tracks[0]->add_tracts(tracks,length_threshold);
-            }
-        }
-    }
-    if(id == 0 && !terminated)
-        progress = 100;
 }
 void vbc_database::clear(void)
 {
     if(!threads.empty())
     {
         terminated = true;
+        if(prog.get())
+            prog->abort();
         wait();
         threads.clear();
         terminated = false;
     }
+    prog.reset();
 }
 void vbc_database::wait(void)
 {
@@ -413,6 +528,129 @@ void vbc_database::save_tracks_files(void)
     }
 }
 
+void fnv_hash(unsigned long long& h,const void* data,size_t size)
+{
+    for(size_t i = 0;i < size;++i)
+    {
+        h ^= ((const unsigned char*)data)[i];
+        h *= 1099511628211ULL;
+    }
+}
+template<class T>
+void fnv_hash(unsigned long long& h,const std::vector<T>& v)
+{
+    size_t size = v.size();
+    fnv_hash(h,&size,sizeof(size));
+    if(size)
+        fnv_hash(h,&v[0],size*sizeof(T));
+}
+
+// identifies the analysis, so that a checkpoint is only resumed by the same analysis.
+// The permutation count is excluded so that a finished analysis can be extended.
+std::string vbc_database::get_permutation_signature(void) const
+{
+    unsigned long long h = 14695981039346656037ULL;
+    fnv_hash(h,&model->type,sizeof(model->type));
+    fnv_hash(h,model->subject_index);
+    fnv_hash(h,model->label);
+    fnv_hash(h,model->X);
+    fnv_hash(h,&model->study_feature,sizeof(model->study_feature));
+    fnv_hash(h,&model->threshold_type,sizeof(model->threshold_type));
+    fnv_hash(h,&fiber_threshold,sizeof(fiber_threshold));
+    fnv_hash(h,&tracking_threshold,sizeof(tracking_threshold));
+    fnv_hash(h,&seed_ratio,sizeof(seed_ratio));
+    fnv_hash(h,&normalize_qa,sizeof(normalize_qa));
+    fnv_hash(h,&track_trimming,sizeof(track_trimming));
+    fnv_hash(h,&fast_null,sizeof(fast_null));
+    // the db contents: the subject values are not hashed, but their names, R2 and SD
+    // change whenever a subject is added, removed or replaced
+    fnv_hash(h,&handle->db.num_subjects,sizeof(handle->db.num_subjects));
+    fnv_hash(h,handle->db.index_name.c_str(),handle->db.index_name.size());
+    for(unsigned int i = 0;i < handle->db.subject_names.size();++i)
+        fnv_hash(h,handle->db.subject_names[i].c_str(),handle->db.subject_names[i].size()+1);
+    fnv_hash(h,handle->db.R2);
+    fnv_hash(h,handle->db.subject_qa_sd);
+    // tracking parameters taken from the template
+    fnv_hash(h,&*handle->dim.begin(),sizeof(*handle->dim.begin())*3);
+    fnv_hash(h,&handle->vs[0],sizeof(handle->vs[0])*3);
+    fnv_hash(h,&voxels_in_threshold,sizeof(voxels_in_threshold));
+    fnv_hash(h,roi_r_list);
+    fnv_hash(h,roi_type);
+    for(unsigned int i = 0;i < roi_list.size();++i)
+        fnv_hash(h,roi_list[i]);
+    for(unsigned int i = 0;i < individual_data.size();++i)
+        fnv_hash(h,individual_data[i]);
+    std::ostringstream out;
+    out << std::hex << h;
+    return out.str();
+}
+
+bool vbc_database::save_checkpoint(void)
+{
+    last_checkpoint = std::chrono::steady_clock::now();
+    std::string tmp_file = checkpoint_file + ".tmp";
+    {
+        gz_mat_write out(tmp_file.c_str());
+        if(!out)
+            return false;
+        std::string signature = get_permutation_signature();
+        unsigned int permutation_count = permutation_done.size();
+        std::vector<unsigned int> done(permutation_done.begin(),permutation_done.end());
+        out.write("signature",signature.c_str(),1,(unsigned int)signature.size());
+        out.write("permutation_count",&permutation_count,1,1);
+        out.write("permutation_done",&done[0],1,permutation_count);
+        out.write("subject_greater_null",&subject_greater_null[0],1,(unsigned int)subject_greater_null.size());
+        out.write("subject_lesser_null",&subject_lesser_null[0],1,(unsigned int)subject_lesser_null.size());
+        out.write("subject_greater",&subject_greater[0],1,(unsigned int)subject_greater.size());
+        out.write("subject_lesser",&subject_lesser[0],1,(unsigned int)subject_lesser.size());
+        out.write("seed_greater_null",&seed_greater_null[0],1,permutation_count);
+        out.write("seed_lesser_null",&seed_lesser_null[0],1,permutation_count);
+        out.write("seed_greater",&seed_greater[0],1,permutation_count);
+        out.write("seed_lesser",&seed_lesser[0],1,permutation_count);
+    }
+    std::remove(checkpoint_file.c_str());
+    return std::rename(tmp_file.c_str(),checkpoint_file.c_str()) == 0;
+}
+
+// restores the permutations completed by the same analysis. Returns false if there is
+// no usable checkpoint. permutation_count is raised if the checkpoint has more permutations.
+bool vbc_database::load_checkpoint(unsigned int& permutation_count)
+{
+    gz_mat_read in;
+    if(checkpoint_file.empty() || !QFileInfo(checkpoint_file.c_str()).exists() ||
+       !in.load_from_file(checkpoint_file.c_str()))
+        return false;
+    unsigned int row,col;
+    const char* signature = 0;
+    const unsigned int* count = 0;
+    if(!in.read("signature",row,col,signature) ||
+       std::string(signature,signature+row*col) != get_permutation_signature() ||
+       !in.read("permutation_count",row,col,count))
+        return false;
+    unsigned int checkpoint_count = *count;
+    const unsigned int *done = 0,*seed[4] = {0,0,0,0},*hist[4] = {0,0,0,0};
+    const char* seed_name[4] = {"seed_greater_null","seed_lesser_null","seed_greater","seed_lesser"};
+    const char* hist_name[4] = {"subject_greater_null","subject_lesser_null","subject_greater","subject_lesser"};
+    std::vector<unsigned int>* seed_data[4] = {&seed_greater_null,&seed_lesser_null,&seed_greater,&seed_lesser};
+    std::vector<unsigned int>* hist_data[4] = {&subject_greater_null,&subject_lesser_null,&subject_greater,&subject_lesser};
+    if(!in.read("permutation_done",row,col,done) || row*col != checkpoint_count)
+        return false;
+    for(unsigned int i = 0;i < 4;++i)
+        if(!in.read(seed_name[i],row,col,seed[i]) || row*col != checkpoint_count ||
+           !in.read(hist_name[i],row,col,hist[i]) || row*col != hist_data[i]->size())
+            return false;
+    permutation_count = std::max<unsigned int>(permutation_count,checkpoint_count);
+    permutation_done.resize(permutation_count);
+    std::copy(done,done+checkpoint_count,permutation_done.begin());
+    for(unsigned int i = 0;i < 4;++i)
+    {
+        seed_data[i]->resize(permutation_count);
+        std::copy(seed[i],seed[i]+checkpoint_count,seed_data[i]->begin());
+        std::copy(hist[i],hist[i]+hist_data[i]->size(),hist_data[i]->begin());
+    }
+    return true;
+}
+
 void vbc_database::run_permutation(unsigned int thread_count,unsigned int permutation_count)
 {
     clear();
@@ -438,6 +676,19 @@ void vbc_database::run_permutation(unsigned int thread_count,unsigned int permut
     seed_greater.resize(permutation_count);
     seed_lesser.clear();
     seed_lesser.resize(permutation_count);
+    permutation_done.clear();
+    permutation_done.resize(permutation_count);
+
+    if(load_checkpoint(permutation_count))
+        std::cout << "resume " << std::count(permutation_done.begin(),permutation_done.end(),1)
+                  << " of " << permutation_count << " permutations from " << checkpoint_file << std::endl;
+    pending_permutation.clear();
+    for(unsigned int i = 0;i < permutation_count;++i)
+        if(!permutation_done[i])
+            pending_permutation.push_back(i);
+    next_permutation = 0;
+    finished_permutation = permutation_count-pending_permutation.size();
+    last_checkpoint = std::chrono::steady_clock::now();
 
     model->rand_gen.reset();
     std::srand(0);
@@ -456,10 +707,15 @@ void vbc_database::run_permutation(unsigned int thread_count,unsigned int permut
         spm_maps.push_back(std::make_shared<connectometry_result>());
     }
     clear();
-    progress = 0;
+    progress = finished_permutation*100/permutation_count;
+    prog = std::make_shared<prog_context>(current_prog());
     for(unsigned int index = 0;index < thread_count;++index)
         threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
-            [this,index,thread_count,permutation_count](){run_permutation_multithread(index,thread_count,permutation_count);})));
+            [this,index,thread_count,permutation_count]()
+            {
+                prog_scope scope(prog.get());
+                run_permutation_multithread(index,thread_count,permutation_count);
+            })));
 }
 void vbc_database::calculate_FDR(void)
 {
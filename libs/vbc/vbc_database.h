@@ -2,6 +2,8 @@
 #define VBC_DATABASE_H
 #include <vector>
 #include <iostream>
+#include <atomic>
+#include <chrono>
 #include "tipl/tipl.hpp"
 #include "gzip_interface.hpp"
 #include "prog_interface_static_link.h"
@@ -40,6 +42,11 @@ public:
     }
 private: // single subject analysis result
     int run_track(const tracking_data& fib,std::vector<std::vector<float> >& track,float seed_ratio = 1.0,unsigned int thread_count = 1);
+    int run_graph(const tracking_data& fib,std::vector<unsigned int>& hist,float seed_ratio = 1.0,unsigned int thread_count = 1);
+public:
+    bool fast_null = false;// estimate the length histograms from the voxel graph instead of tracking (whole brain, no trimming)
+    int get_length_hist(const tracking_data& fib,std::vector<std::vector<float> >& tracks,
+                        std::vector<unsigned int>& hist,bool keep_tracks);
 public:// for FDR analysis
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::vector<unsigned int> subject_greater_null;
@@ -54,6 +61,18 @@ public:// for FDR analysis
     std::vector<unsigned int> seed_lesser;
     unsigned int progress;// 0~100
     bool terminated = false;
+    std::shared_ptr<prog_context> prog;// cancels the tracking in all permutation threads
+public:// permutation checkpoint, resumed or extended by a run of the same analysis
+    std::string checkpoint_file;
+    unsigned int checkpoint_interval = 60;// seconds
+    std::vector<unsigned char> permutation_done;
+    std::vector<unsigned int> pending_permutation;
+    std::atomic<unsigned int> next_permutation,finished_permutation;
+    std::mutex lock_permutation;
+    std::chrono::steady_clock::time_point last_checkpoint;
+    std::string get_permutation_signature(void) const;
+    bool save_checkpoint(void);
+    bool load_checkpoint(unsigned int& permutation_count);
 public:
     std::vector<std::vector<tipl::vector<3,short> > > roi_list;
     std::vector<float> roi_r_list;
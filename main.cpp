@@ -36,6 +36,8 @@ int vis(void);
 int ren(void);
 int cnn(void);
 int qc(void);
+int bench(void);
+int server(void);
 
 
 QStringList search_files(QString dir,QString filter)
@@ -188,6 +190,10 @@ int run_cmd(int ac, char *av[])
             return cnn();
         if(po.get("action") == std::string("qc"))
             return qc();
+        if(po.get("action") == std::string("bench"))
+            return bench();
+        if(po.get("action") == std::string("server"))
+            return server();
         if(po.get("action") == std::string("vis"))
         {
             vis();
@@ -2,8 +2,16 @@
 #define PROGRAM_OPTION_HPP
 #include <map>
 #include <sstream>
+class program_option;
+extern program_option po;
 class program_option{
     std::map<std::string,std::string> options;
+    // the global po reads the options bound to the calling thread, if any
+    std::map<std::string,std::string>& get_options(void)
+    {
+        program_option* job = bound_options();
+        return (job && this == &po) ? job->options : options;
+    }
     void add_option(const std::string& str)
     {
         if(str.length() < 3 || str[0] != '-' || str[1] != '-')
@@ -14,6 +22,13 @@ class program_option{
         options[std::string(str.begin()+2,pos)] = std::string(pos+1,str.end());
     }
 
+public:
+    // options bound to this thread by a server job
+    static program_option*& bound_options(void)
+    {
+        thread_local program_option* job = 0;
+        return job;
+    }
 public:
     void init(int ac, char *av[])
     {
@@ -38,14 +53,14 @@ public:
 
     bool has(const char* name)
     {
-        return options.find(name) != options.end();
+        return get_options().find(name) != get_options().end();
     }
 
     std::string get(const char* name)
     {
         std::string df;
-        auto value = options.find(name);
-        if(value != options.end())
+        auto value = get_options().find(name);
+        if(value != get_options().end())
             df = value->second;
         return df;
     }
@@ -53,8 +68,8 @@ public:
     std::string get(const char* name,const char* df_ptr)
     {
         std::string df;
-        auto value = options.find(name);
-        if(value != options.end())
+        auto value = get_options().find(name);
+        if(value != get_options().end())
             df = value->second;
         else
             df = df_ptr;
@@ -63,14 +78,34 @@ public:
     template<class value_type>
     value_type get(const char* name,value_type df)
     {
-        auto value = options.find(name);
-        if(value != options.end())
+        auto value = get_options().find(name);
+        if(value != get_options().end())
             std::istringstream(value->second) >> df;
         return df;
     }
+    template<class value_type>
+    void set(const char* name,value_type value)
+    {
+        std::ostringstream out;
+        out << value;
+        get_options()[name] = out.str();
+    }
 };
 
 
-extern program_option po;
+// binds job options to the calling thread, so that po reads them there.
+// Other threads, including the worker threads started by the job, still read the global options.
+class program_option_scope{
+    program_option* prev;
+public:
+    program_option_scope(program_option* job):prev(program_option::bound_options())
+    {
+        program_option::bound_options() = job;
+    }
+    ~program_option_scope(void)
+    {
+        program_option::bound_options() = prev;
+    }
+};
 #endif // PROGRAM_OPTION_HPP
 
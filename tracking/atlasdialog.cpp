@@ -5,11 +5,13 @@
 #include "region/regiontablewidget.h"
 #include "atlas.hpp"
 extern std::vector<atlas> atlas_list;
+void preload_atlas(void);
 AtlasDialog::AtlasDialog(QWidget *parent) :
     QDialog(parent),
     ui(new Ui::AtlasDialog)
 {
     ui->setupUi(this);
+    preload_atlas();
     ui->region_list->setModel(new QStringListModel);
     ui->region_list->setSelectionModel(new QItemSelectionModel(ui->region_list->model()));
     for(int index = 0; index < atlas_list.size(); ++index)
@@ -6,6 +6,132 @@
 #include "SliceModel.h"
 #include "libs/gzip_interface.hpp"
 
+void region_runs::encode(const std::vector<tipl::vector<3,short> >& sorted_points)
+{
+    start.clear();
+    length.clear();
+    for(size_t i = 0;i < sorted_points.size();++i)
+    {
+        if(!start.empty() && length.back() < 65535)
+        {
+            const tipl::vector<3,short>& s = start.back();
+            if(s[0] == sorted_points[i][0] && s[1] == sorted_points[i][1] &&
+               int(s[2])+int(length.back()) == int(sorted_points[i][2]))
+            {
+                ++length.back();
+                continue;
+            }
+        }
+        start.push_back(sorted_points[i]);
+        length.push_back(1);
+    }
+}
+// ---------------------------------------------------------------------------
+void region_runs::decode(std::vector<tipl::vector<3,short> >& points) const
+{
+    points.clear();
+    for(size_t i = 0;i < start.size();++i)
+    {
+        tipl::vector<3,short> p(start[i]);
+        for(unsigned short j = 0;j < length[i];++j,++p[2])
+            points.push_back(p);
+    }
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::sort_region(void)
+{
+    if(!std::is_sorted(region.begin(),region.end()))
+        std::sort(region.begin(),region.end());
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::push_undo(region_change& change)
+{
+    redo_backup.clear();
+    undo_memory += change.memory();
+    undo_backup.push_back(region_change());
+    std::swap(undo_backup.back(),change);
+    // drop the oldest edits once the history exceeds the budget
+    size_t drop = 0;
+    while(undo_memory > max_undo_memory && drop+1 < undo_backup.size())
+        undo_memory -= undo_backup[drop++].memory();
+    if(drop)
+        undo_backup.erase(undo_backup.begin(),undo_backup.begin()+drop);
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::push_undo(std::vector<tipl::vector<3,short> >& old_region)
+{
+    sort_region();
+    if(!std::is_sorted(old_region.begin(),old_region.end()))
+        std::sort(old_region.begin(),old_region.end());
+    std::vector<tipl::vector<3,short> > diff;
+    region_change change;
+    std::set_difference(region.begin(),region.end(),old_region.begin(),old_region.end(),std::back_inserter(diff));
+    change.added.encode(diff);
+    diff.clear();
+    std::set_difference(old_region.begin(),old_region.end(),region.begin(),region.end(),std::back_inserter(diff));
+    change.removed.encode(diff);
+    push_undo(change);
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::apply_change(const region_change& change,bool undo)
+{
+    if(change.is_shift)
+    {
+        tipl::vector<3,short> dx(change.shift);
+        if(undo)
+            dx = tipl::vector<3,short>(-dx[0],-dx[1],-dx[2]);
+        tipl::par_for(region.size(),[&](unsigned int index)
+        {
+            region[index] += dx;
+        });
+        modified = true;
+        return;
+    }
+    if(change.flip_dim >= 0)
+    {
+        Flip(change.flip_dim,false);
+        return;
+    }
+    sort_region();
+    std::vector<tipl::vector<3,short> > to_remove,to_add,result;
+    (undo ? change.added : change.removed).decode(to_remove);
+    (undo ? change.removed : change.added).decode(to_add);
+    if(!to_remove.empty())
+    {
+        std::set_difference(region.begin(),region.end(),to_remove.begin(),to_remove.end(),std::back_inserter(result));
+        region.swap(result);
+        result.clear();
+    }
+    if(!to_add.empty())
+    {
+        std::set_union(region.begin(),region.end(),to_add.begin(),to_add.end(),std::back_inserter(result));
+        region.swap(result);
+    }
+    modified = true;
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::undo(void)
+{
+    if(undo_backup.empty())
+        return;
+    apply_change(undo_backup.back(),true);
+    undo_memory -= undo_backup.back().memory();
+    redo_backup.push_back(region_change());
+    std::swap(redo_backup.back(),undo_backup.back());
+    undo_backup.pop_back();
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::redo(void)
+{
+    if(redo_backup.empty())
+        return;
+    apply_change(redo_backup.back(),false);
+    undo_memory += redo_backup.back().memory();
+    undo_backup.push_back(region_change());
+    std::swap(undo_backup.back(),redo_backup.back());
+    redo_backup.pop_back();
+}
+// ---------------------------------------------------------------------------
 tipl::geometry<3> ROIRegion::get_buffer_dim(void) const
 {
     return tipl::geometry<3>(handle->dim[0]*resolution_ratio,
@@ -28,8 +154,6 @@ void ROIRegion::add_points(std::vector<tipl::vector<3,float> >& points,bool del,
 void ROIRegion::add_points(std::vector<tipl::vector<3,short> >& points, bool del,float point_resolution)
 {
     change_resolution(points,point_resolution);
-    if(!region.empty())
-        undo_backup.push_back(region);
     if(resolution_ratio == 1.0)
     {
         for(unsigned int index = 0; index < points.size();)
@@ -54,7 +178,32 @@ void ROIRegion::add_points(std::vector<tipl::vector<3,short> >& points, bool del
             ++index;
     }
     if(points.empty())
+    {
+        // an empty edit marks an undo point for the moves that follow
+        if(!region.empty())
+        {
+            region_change change;
+            change.is_shift = true;
+            push_undo(change);
+        }
         return;
+    }
+    // record only the points that actually change
+    {
+        sort_region();
+        std::sort(points.begin(),points.end());
+        points.erase(std::unique(points.begin(),points.end()),points.end());
+        std::vector<tipl::vector<3,short> > changed_points;
+        for(size_t i = 0;i < points.size();++i)
+            if(std::binary_search(region.begin(),region.end(),points[i]) == del)
+                changed_points.push_back(points[i]);
+        // nothing changes, so there is nothing to undo
+        if(changed_points.empty())
+            return;
+        region_change change;
+        (del ? change.removed : change.added).encode(changed_points);
+        push_undo(change);
+    }
     if(points.size()+ region.size() > 5000000)
     {
         // for roll back
@@ -406,13 +555,18 @@ void ROIRegion::perform(const std::string& action)
 }
 
 // ---------------------------------------------------------------------------
-void ROIRegion::Flip(unsigned int dimension) {
+void ROIRegion::Flip(unsigned int dimension,bool record_undo) {
     modified = true;
-    if(!region.empty())
-        undo_backup.push_back(region);
     for (unsigned int index = 0; index < region.size(); ++index)
         region[index][dimension] = (float)handle->dim[dimension]*resolution_ratio -
                                    region[index][dimension] - 1;
+    // flipping is its own inverse, so only the dimension is recorded
+    if(record_undo)
+    {
+        region_change change;
+        change.flip_dim = dimension;
+        push_undo(change);
+    }
 }
 
 // ---------------------------------------------------------------------------
@@ -425,6 +579,14 @@ void ROIRegion::shift(tipl::vector<3,float> dx) {
     {
         region[index] += dx;
     });
+    // consecutive moves are merged into one undo step
+    if(undo_backup.empty() || !undo_backup.back().is_shift || !redo_backup.empty())
+    {
+        region_change change;
+        change.is_shift = true;
+        push_undo(change);
+    }
+    undo_backup.back().shift += tipl::vector<3,short>(dx);
 }
 // ---------------------------------------------------------------------------
 template<class Image,class Points>
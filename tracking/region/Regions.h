@@ -16,13 +16,38 @@ const unsigned int end_id = 2;
 const unsigned int seed_id = 3;
 const unsigned int terminate_id = 4;
 
+// sorted points stored as runs of consecutive z
+struct region_runs{
+        std::vector<tipl::vector<3,short> > start;
+        std::vector<unsigned short> length;
+        void encode(const std::vector<tipl::vector<3,short> >& sorted_points);
+        void decode(std::vector<tipl::vector<3,short> >& points) const;
+        bool empty(void) const{return start.empty();}
+        size_t memory(void) const{return start.size()*(sizeof(tipl::vector<3,short>)+sizeof(unsigned short));}
+};
+// one edit of a region, stored as the difference so that undo memory scales with the edit
+struct region_change{
+        region_runs added,removed;
+        tipl::vector<3,short> shift = tipl::vector<3,short>(0,0,0);
+        bool is_shift = false;
+        int flip_dim = -1;
+        size_t memory(void) const{return added.memory()+removed.memory();}
+};
+
 class ROIRegion {
 public:
         std::shared_ptr<fib_data> handle;
         std::vector<tipl::vector<3,short> > region;
         bool modified;
-        std::vector<std::vector<tipl::vector<3,short> > > undo_backup;
-        std::vector<std::vector<tipl::vector<3,short> > > redo_backup;
+        std::vector<region_change> undo_backup;
+        std::vector<region_change> redo_backup;
+        size_t undo_memory = 0;
+        static const size_t max_undo_memory = 64*1024*1024;
+private:
+        void sort_region(void);
+        void push_undo(region_change& change);
+        void push_undo(std::vector<tipl::vector<3,short> >& old_region);
+        void apply_change(const region_change& change,bool undo);
 public:
         bool super_resolution = false;
         float resolution_ratio = 1.0;
@@ -43,6 +68,7 @@ public: // rendering options
             region = rhs.region;
             undo_backup = rhs.undo_backup;
             redo_backup = rhs.redo_backup;
+            undo_memory = rhs.undo_memory;
             regions_feature = rhs.regions_feature;
             show_region = rhs.show_region;
             modified = true;
@@ -55,6 +81,7 @@ public: // rendering options
             region.swap(rhs.region);
             undo_backup.swap(rhs.undo_backup);
             redo_backup.swap(rhs.redo_backup);
+            std::swap(undo_memory,rhs.undo_memory);
             std::swap(regions_feature,rhs.regions_feature);
             show_region.swap(rhs.show_region);
             std::swap(modified,rhs.modified);
@@ -155,34 +182,11 @@ public:
         }
         void add_points(std::vector<tipl::vector<3,float> >& points,bool del,float point_resolution = 1.0);
         void add_points(std::vector<tipl::vector<3,short> >& points,bool del,float point_resolution = 1.0);
-        void undo(void)
-        {
-            if(region.empty() && undo_backup.empty())
-                return;
-            redo_backup.push_back(std::vector<tipl::vector<3,short> >());
-            redo_backup.back().swap(region);
-            if(!undo_backup.empty())
-            {
-                region.swap(undo_backup.back());
-                undo_backup.pop_back();
-            }
-            modified = true;
-
-        }
-        void redo(void)
-        {
-            if(redo_backup.empty())
-                return;
-            undo_backup.push_back(std::vector<tipl::vector<3,short> >());
-            undo_backup.back().swap(region);
-            region.swap(redo_backup.back());
-            redo_backup.pop_back();
-            modified = true;
-
-        }
+        void undo(void);
+        void redo(void);
         void SaveToFile(const char* FileName);
         bool LoadFromFile(const char* FileName);
-        void Flip(unsigned int dimension);
+        void Flip(unsigned int dimension,bool record_undo = true);
         void shift(tipl::vector<3,float> dx);
 
         template<class image_type>
@@ -223,9 +227,8 @@ public:
         void LoadFromBuffer(const image_type& mask)
         {
             modified = true;
-            if(!region.empty())
-                undo_backup.push_back(region);
-            region.clear();
+            std::vector<tipl::vector<3,short> > old_region;
+            old_region.swap(region);
             std::vector<tipl::vector<3,short> > points;
             for (tipl::pixel_index<3>index(mask.geometry());index < mask.size();++index)
                 if (mask[index.index()] != 0)
@@ -233,6 +236,7 @@ public:
             if(mask.width() != handle->dim[0])
                 resolution_ratio = (float)mask.width()/(float)handle->dim[0];
             region.swap(points);
+            push_undo(old_region);
         }
         void SaveToBuffer(tipl::image<unsigned char, 3>& mask,unsigned char value=255);
         void perform(const std::string& action);